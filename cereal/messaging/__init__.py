@@ -47,10 +47,14 @@ def pub_sock(endpoint: str) -> PubSocket:
   return sock
 
 def sub_sock(endpoint: str, poller: Optional[Poller] = None, addr: str = "127.0.0.1",
-             conflate: bool = False, timeout: Optional[int] = None) -> SubSocket:
+             conflate: bool = False, timeout: Optional[int] = None, history: int = 0) -> SubSocket:
   sock = SubSocket()
   sock.connect(context, endpoint, addr.encode('utf8'), conflate)
 
+  # replay up to the last history messages still in the queue
+  if history > 0:
+    sock.rewind(history)
+
   if timeout is not None:
     sock.setTimeout(timeout)
 
@@ -136,7 +140,7 @@ def recv_one_retry(sock: SubSocket) -> capnp.lib.capnp._DynamicStructReader:
 class SubMaster():
   def __init__(self, services: List[str], poll: Optional[List[str]] = None,
                ignore_alive: Optional[List[str]] = None, ignore_avg_freq: Optional[List[str]] = None,
-               addr: str = "127.0.0.1"):
+               addr: str = "127.0.0.1", replay: Optional[List[str]] = None):
     self.frame = -1
     self.updated = {s: False for s in services}
     self.rcv_time = {s: 0. for s in services}
@@ -148,6 +152,7 @@ class SubMaster():
     self.data = {}
     self.valid = {}
     self.logMonoTime = {}
+    self.trace = {}
 
     self.poller = Poller()
     self.non_polled_services = [s for s in services if poll is not None and
@@ -159,7 +164,8 @@ class SubMaster():
     for s in services:
       if addr is not None:
         p = self.poller if s not in self.non_polled_services else None
-        self.sock[s] = sub_sock(s, poller=p, addr=addr, conflate=True)
+        self.sock[s] = sub_sock(s, poller=p, addr=addr, conflate=True,
+                                history=1 if replay is not None and s in replay else 0)
       self.freq[s] = service_list[s].frequency
 
       try:
@@ -169,6 +175,7 @@ class SubMaster():
 
       self.data[s] = getattr(data, s)
       self.logMonoTime[s] = 0
+      self.trace[s] = data.trace
       self.valid[s] = data.valid
 
   def __getitem__(self, s: str) -> capnp.lib.capnp._DynamicStructReader:
@@ -202,6 +209,7 @@ class SubMaster():
       self.rcv_frame[s] = self.frame
       self.data[s] = getattr(msg, s)
       self.logMonoTime[s] = msg.logMonoTime
+      self.trace[s] = msg.trace
       self.valid[s] = msg.valid
 
       if SIMULATION:
@@ -249,3 +257,6 @@ class PubMaster():
 
   def all_readers_updated(self, s: str) -> bool:
     return self.sock[s].all_readers_updated()
+
+  def wait_readers_updated(self, s: str, timeout: int = -1) -> bool:
+    return self.sock[s].wait_readers_updated(timeout)
@@ -1,16 +1,23 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <csignal>
+#include <cstring>
 #include <iostream>
 #include <map>
 #include <string>
+#include <vector>
 
 typedef void (*sighandler_t)(int sig);
 
+#include "bridge_batch.h"
 #include "impl_msgq.h"
 #include "impl_zmq.h"
 #include "services.h"
 
+// Batched mode sends its frames on BATCH_PORT
+#define BATCH_PORT "8100"
+
 void sigpipe_handler(int sig) {
   assert(sig == SIGPIPE);
   std::cout << "SIGPIPE received" << std::endl;
@@ -29,12 +36,179 @@ static std::vector<std::string> get_services(std::string whitelist_str, bool zmq
   return service_list;
 }
 
+static int get_service_idx(const std::string &name) {
+  for (int i = 0; i < NUM_SERVICES; i++) {
+    if (name == services[i].name) return i;
+  }
+  return -1;
+}
+
+class ThroughputStats {
+public:
+  void add(size_t raw) {
+    msgs++;
+    raw_bytes += raw;
+  }
+  void frame(size_t wire) {
+    frames++;
+    sent_bytes += wire;
+  }
+  void report() {
+    auto now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now - last).count();
+    if (dt < 5.0) return;
+
+    std::cout << "bridge: " << msgs / dt << " msgs/s, " << frames / dt << " frames/s, "
+              << raw_bytes / dt / 1024 << " kB/s raw, " << sent_bytes / dt / 1024 << " kB/s on the wire, "
+              << skipped / dt << " decimated msgs/s" << std::endl;
+    msgs = frames = raw_bytes = sent_bytes = skipped = 0;
+    last = now;
+  }
+  uint64_t skipped = 0;
+
+private:
+  uint64_t msgs = 0, frames = 0, raw_bytes = 0, sent_bytes = 0;
+  std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+};
+
+// Forward every n-th message of a service, n is the qlog decimation from services.py
+class Decimator {
+public:
+  Decimator(bool enabled) : enabled(enabled), counters(NUM_SERVICES, 0) {}
+  bool keep(int service) {
+    int decimation = services[service].decimation;
+    if (!enabled || decimation <= 1) return true;
+    return (counters[service]++ % decimation) == 0;
+  }
+
+private:
+  bool enabled;
+  std::vector<uint64_t> counters;
+};
+
+static void msgq_to_zmq_batched(bool compress, bool decimate) {
+  MSGQContext sub_context;
+  ZMQContext pub_context;
+  MSGQPoller poller;
+
+  ZMQPubSocket pub_sock;
+  pub_sock.connect(&pub_context, BATCH_PORT, false);
+
+  std::map<SubSocket*, int> sub2idx;
+  for (auto endpoint : get_services("", false)) {
+    SubSocket *sub_sock = new MSGQSubSocket();
+    sub_sock->connect(&sub_context, endpoint, "127.0.0.1", false);
+    poller.registerSocket(sub_sock);
+    sub2idx[sub_sock] = get_service_idx(endpoint);
+  }
+
+  ThroughputStats stats;
+  Decimator decimator(decimate);
+  BatchEncoder encoder;
+
+  auto send_frame = [&]() {
+    const std::vector<char> &frame = encoder.finish(compress);
+    pub_sock.send((char *)frame.data(), frame.size());
+    stats.frame(frame.size());
+  };
+
+  while (true) {
+    // Drain everything that is ready into one frame
+    for (auto sub_sock : poller.poll(100)) {
+      Message *msg;
+      while ((msg = sub_sock->receive(true)) != NULL) {
+        int idx = sub2idx[sub_sock];
+        if (!decimator.keep(idx)) {
+          stats.skipped++;
+          delete msg;
+          continue;
+        }
+
+        bool added = encoder.add(idx, msg->getData(), msg->getSize());
+        if (!added && !encoder.empty()) {
+          // The frame is full, start the next one
+          send_frame();
+          added = encoder.add(idx, msg->getData(), msg->getSize());
+        }
+        if (added) {
+          stats.add(msg->getSize());
+        } else {
+          std::cout << "bridge: message of " << msg->getSize() << " bytes too large to batch" << std::endl;
+        }
+        delete msg;
+      }
+    }
+
+    if (!encoder.empty()) send_frame();
+    stats.report();
+  }
+}
+
+static void zmq_to_msgq_batched(std::string ip, std::string whitelist_str) {
+  ZMQContext sub_context;
+  MSGQContext pub_context;
+
+  ZMQSubSocket sub_sock;
+  sub_sock.connect(&sub_context, BATCH_PORT, ip, false, false);
+
+  std::vector<PubSocket*> pub_socks(NUM_SERVICES, nullptr);
+  for (auto endpoint : get_services(whitelist_str, true)) {
+    PubSocket *pub_sock = new MSGQPubSocket();
+    pub_sock->connect(&pub_context, endpoint);
+    pub_socks[get_service_idx(endpoint)] = pub_sock;
+  }
+
+  ThroughputStats stats;
+  std::vector<char> raw;
+
+  while (true) {
+    Message *msg = sub_sock.receive();
+    if (msg == NULL) continue;
+    stats.frame(msg->getSize());
+
+    batch_decode(msg->getData(), msg->getSize(), raw, [&](uint16_t service, const char *data, size_t size) {
+      if (service < NUM_SERVICES && pub_socks[service] != nullptr) {
+        pub_socks[service]->send((char *)data, size);
+        stats.add(size);
+      }
+    });
+
+    delete msg;
+    stats.report();
+  }
+}
+
 int main(int argc, char** argv) {
   signal(SIGPIPE, (sighandler_t)sigpipe_handler);
 
-  bool zmq_to_msgq = argc > 2;
-  std::string ip = zmq_to_msgq ? argv[1] : "127.0.0.1";
-  std::string whitelist_str = zmq_to_msgq ? std::string(argv[2]) : "";
+  // Flags can be mixed with the positional <ip> <whitelist> arguments
+  bool batch = false, compress = false, decimate = false;
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--batch") {
+      batch = true;
+    } else if (arg == "--compress") {
+      compress = true;
+    } else if (arg == "--decimate") {
+      decimate = true;
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  bool zmq_to_msgq = args.size() > 1;
+  std::string ip = zmq_to_msgq ? args[0] : "127.0.0.1";
+  std::string whitelist_str = zmq_to_msgq ? args[1] : "";
+
+  if (batch) {
+    if (zmq_to_msgq) {
+      zmq_to_msgq_batched(ip, whitelist_str);
+    } else {
+      msgq_to_zmq_batched(compress, decimate);
+    }
+    return 0;
+  }
 
   Poller *poller;
   Context *pub_context;
@@ -50,6 +224,7 @@ int main(int argc, char** argv) {
   }
 
   std::map<SubSocket*, PubSocket*> sub2pub;
+  std::map<SubSocket*, int> sub2idx;
   for (auto endpoint: get_services(whitelist_str, zmq_to_msgq)) {
     PubSocket * pub_sock;
     SubSocket * sub_sock;
@@ -65,13 +240,17 @@ int main(int argc, char** argv) {
 
     poller->registerSocket(sub_sock);
     sub2pub[sub_sock] = pub_sock;
+    sub2idx[sub_sock] = get_service_idx(endpoint);
   }
 
+  Decimator decimator(decimate && !zmq_to_msgq);
   while (true) {
     for (auto sub_sock : poller->poll(100)) {
       Message * msg = sub_sock->receive();
       if (msg == NULL) continue;
-      sub2pub[sub_sock]->sendMessage(msg);
+      if (decimator.keep(sub2idx[sub_sock])) {
+        sub2pub[sub_sock]->sendMessage(msg);
+      }
       delete msg;
     }
   }
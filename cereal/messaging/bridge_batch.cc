@@ -0,0 +1,79 @@
+#include <cstring>
+#include <iostream>
+
+#include <zlib.h>
+
+#include "bridge_batch.h"
+
+bool BatchEncoder::add(uint16_t service, const char *data, size_t size) {
+  if (raw.size() + sizeof(BatchEntry) + size > BATCH_MAX_RAW_SIZE) return false;
+
+  BatchEntry entry = {service, (uint32_t)size};
+  raw.insert(raw.end(), (char *)&entry, (char *)&entry + sizeof(entry));
+  raw.insert(raw.end(), data, data + size);
+  count++;
+  return true;
+}
+
+const std::vector<char> &BatchEncoder::finish(bool compress) {
+  BatchHeader header = {0, count, (uint32_t)raw.size()};
+  frame.resize(sizeof(header) + compressBound(raw.size()));
+
+  size_t payload_size = raw.size();
+  if (compress) {
+    uLongf compressed_size = frame.size() - sizeof(header);
+    int err = compress2((Bytef *)frame.data() + sizeof(header), &compressed_size, (const Bytef *)raw.data(), raw.size(), Z_BEST_SPEED);
+    if (err == Z_OK && compressed_size < raw.size()) {
+      header.flags |= BATCH_COMPRESSED;
+      payload_size = compressed_size;
+    }
+  }
+  if (!(header.flags & BATCH_COMPRESSED)) {
+    memcpy(frame.data() + sizeof(header), raw.data(), raw.size());
+  }
+  memcpy(frame.data(), &header, sizeof(header));
+  frame.resize(sizeof(header) + payload_size);
+
+  raw.clear();
+  count = 0;
+  return frame;
+}
+
+bool batch_decode(const char *data, size_t size, std::vector<char> &raw,
+                  const std::function<void(uint16_t service, const char *data, size_t size)> &fn) {
+  if (size < sizeof(BatchHeader)) return false;
+
+  BatchHeader header;
+  memcpy(&header, data, sizeof(header));
+  const char *payload = data + sizeof(header);
+  size_t payload_size = size - sizeof(header);
+
+  if (header.flags & BATCH_COMPRESSED) {
+    // raw_size comes from the network
+    if (header.raw_size > BATCH_MAX_RAW_SIZE) {
+      std::cout << "bridge: dropping frame of " << header.raw_size << " bytes" << std::endl;
+      return false;
+    }
+    raw.resize(header.raw_size);
+    uLongf raw_size = header.raw_size;
+    if (uncompress((Bytef *)raw.data(), &raw_size, (const Bytef *)payload, payload_size) != Z_OK || raw_size != header.raw_size) {
+      std::cout << "bridge: failed to decompress frame" << std::endl;
+      return false;
+    }
+    payload = raw.data();
+    payload_size = raw_size;
+  }
+
+  size_t offset = 0;
+  for (uint32_t i = 0; i < header.count; i++) {
+    if (offset + sizeof(BatchEntry) > payload_size) return false;
+    BatchEntry entry;
+    memcpy(&entry, payload + offset, sizeof(entry));
+    offset += sizeof(entry);
+    if (entry.size > payload_size - offset) return false;
+
+    fn(entry.service, payload + offset, entry.size);
+    offset += entry.size;
+  }
+  return true;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Batched mode sends all messages received in one poll as a single frame.
+// Frame: BatchHeader, then [uint16 service index, uint32 size, data] per message.
+// With BATCH_COMPRESSED everything after the header is zlib compressed.
+#define BATCH_COMPRESSED 1
+// Frames claiming more are dropped by the receiver, the sender splits its batches to stay below
+#define BATCH_MAX_RAW_SIZE (64 * 1024 * 1024)
+
+struct __attribute__((packed)) BatchHeader {
+  uint32_t flags;
+  uint32_t count;
+  uint32_t raw_size;
+};
+
+struct __attribute__((packed)) BatchEntry {
+  uint16_t service;
+  uint32_t size;
+};
+
+class BatchEncoder {
+public:
+  // Returns false if the message doesn't fit, finish the frame and add it again
+  bool add(uint16_t service, const char *data, size_t size);
+  bool empty() const { return count == 0; }
+  // The frame of everything added since the last finish
+  const std::vector<char> &finish(bool compress);
+
+private:
+  uint32_t count = 0;
+  std::vector<char> raw, frame;
+};
+
+// Calls fn for every message in the frame. Returns false for malformed frames, messages
+// before the error have already been passed to fn. raw is scratch space for decompression.
+bool batch_decode(const char *data, size_t size, std::vector<char> &raw,
+                  const std::function<void(uint16_t service, const char *data, size_t size)> &fn);
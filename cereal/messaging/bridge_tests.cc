@@ -0,0 +1,96 @@
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "catch2/catch.hpp"
+#include "bridge_batch.h"
+#include "msgq.h"
+
+static void new_queues(msgq_queue_t *pub, msgq_queue_t *sub, const char *prefix) {
+  msgq_set_prefix(prefix);
+  remove((msgq_shm_dir() + "/test_bridge").c_str());
+  REQUIRE(msgq_new_queue(pub, "test_bridge", 1024 * 1024) == 0);
+  REQUIRE(msgq_new_queue(sub, "test_bridge", 1024 * 1024) == 0);
+  msgq_init_publisher(pub);
+  msgq_init_subscriber(sub);
+  msgq_set_prefix(NULL);
+}
+
+TEST_CASE("Batched bridge loopback between two prefixes"){
+  bool compress = GENERATE(false, true);
+
+  msgq_queue_t pub_a, sub_a, pub_b, sub_b;
+  new_queues(&pub_a, &sub_a, "bridge_test_a");
+  new_queues(&pub_b, &sub_b, "bridge_test_b");
+
+  std::vector<std::string> sent;
+  for (int i = 0; i < 10; i++) {
+    sent.push_back(std::string(i * 100 + 1, 'a' + i));
+    msgq_msg_t msg;
+    msgq_msg_init_data(&msg, (char *)sent.back().data(), sent.back().size());
+    msgq_msg_send(&msg, &pub_a);
+    msgq_msg_close(&msg);
+  }
+
+  // msgq -> frame
+  BatchEncoder encoder;
+  msgq_msg_t msg;
+  while (msgq_msg_recv(&msg, &sub_a) > 0) {
+    REQUIRE(encoder.add(7, msg.data, msg.size));
+    msgq_msg_close(&msg);
+  }
+  std::vector<char> frame = encoder.finish(compress);
+  REQUIRE(encoder.empty());
+
+  // frame -> msgq in the other prefix
+  std::vector<char> raw;
+  REQUIRE(batch_decode(frame.data(), frame.size(), raw, [&](uint16_t service, const char *data, size_t size) {
+    REQUIRE(service == 7);
+    msgq_msg_t out;
+    msgq_msg_init_data(&out, (char *)data, size);
+    msgq_msg_send(&out, &pub_b);
+    msgq_msg_close(&out);
+  }));
+
+  for (auto &s : sent) {
+    REQUIRE(msgq_msg_recv(&msg, &sub_b) == (int)s.size());
+    REQUIRE(std::string(msg.data, msg.size) == s);
+    msgq_msg_close(&msg);
+  }
+  REQUIRE(msgq_msg_recv(&msg, &sub_b) == 0);
+
+  // Truncated frames stop at the last complete message
+  int received = 0;
+  auto count = [&](uint16_t, const char *, size_t) { received++; };
+  if (!compress) {
+    REQUIRE(!batch_decode(frame.data(), frame.size() - 1, raw, count));
+    REQUIRE(received == (int)sent.size() - 1);
+  }
+
+  for (auto q : {&pub_a, &sub_a, &pub_b, &sub_b}) msgq_close_queue(q);
+  for (auto dir : {"/dev/shm/bridge_test_a", "/dev/shm/bridge_test_b"}) {
+    remove((std::string(dir) + "/test_bridge").c_str());
+    rmdir(dir);
+  }
+}
+
+TEST_CASE("Batched bridge drops oversized frames"){
+  BatchHeader header = {BATCH_COMPRESSED, 1, 0xFFFFFFFF};
+  std::vector<char> frame((char *)&header, (char *)&header + sizeof(header));
+  frame.resize(frame.size() + 16);
+
+  std::vector<char> raw;
+  int received = 0;
+  REQUIRE(!batch_decode(frame.data(), frame.size(), raw, [&](uint16_t, const char *, size_t) { received++; }));
+  REQUIRE(received == 0);
+  REQUIRE(raw.size() == 0);
+
+  // The encoder splits instead of producing them
+  BatchEncoder encoder;
+  std::vector<char> big(BATCH_MAX_RAW_SIZE / 2);
+  REQUIRE(encoder.add(0, big.data(), big.size()));
+  REQUIRE(!encoder.add(0, big.data(), big.size()));
+  encoder.finish(false);
+  REQUIRE(encoder.add(0, big.data(), big.size()));
+}
@@ -25,14 +25,19 @@ static bool service_exists(std::string path){
   return false;
 }
 
+// Ring sizes come from services.py, other endpoints get the default
 static size_t get_size(std::string endpoint){
-  size_t sz = DEFAULT_SEGMENT_SIZE;
-
-  if (endpoint == "roadCameraState" || endpoint == "driverCameraState" || endpoint == "wideRoadCameraState"){
-    sz *= 10;
+  for (const auto& it : services) {
+    if (endpoint == it.name) return it.segment_size;
   }
+  return DEFAULT_SEGMENT_SIZE;
+}
 
-  return sz;
+static bool is_multi_publisher(std::string endpoint){
+  for (const auto& it : services) {
+    if (endpoint == it.name) return it.multi_publisher;
+  }
+  return false;
 }
 
 
@@ -45,21 +50,30 @@ MSGQContext::~MSGQContext() {
 void MSGQMessage::init(size_t sz) {
   size = sz;
   data = new char[size];
+  owner = true;
 }
 
 void MSGQMessage::init(char * d, size_t sz) {
   size = sz;
   data = new char[size];
+  owner = true;
   memcpy(data, d, size);
 }
 
 void MSGQMessage::takeOwnership(char * d, size_t sz) {
   size = sz;
   data = d;
+  owner = true;
+}
+
+void MSGQMessage::borrow(char * d, size_t sz) {
+  size = sz;
+  data = d;
+  owner = false;
 }
 
 void MSGQMessage::close() {
-  if (size > 0){
+  if (size > 0 && owner){
     delete[] data;
   }
   size = 0;
@@ -95,7 +109,7 @@ int MSGQSubSocket::connect(Context *context, std::string endpoint, std::string a
 }
 
 
-Message * MSGQSubSocket::receive(bool non_blocking){
+Message * MSGQSubSocket::receive(bool non_blocking, bool lease){
   msgq_do_exit = 0;
 
   void (*prev_handler_sigint)(int);
@@ -109,7 +123,8 @@ Message * MSGQSubSocket::receive(bool non_blocking){
 
   MSGQMessage *r = NULL;
 
-  int rc = msgq_msg_recv(&msg, q);
+  auto recv = lease ? msgq_msg_recv_lease : msgq_msg_recv;
+  int rc = recv(&msg, q);
 
   // Hack to implement blocking read with a poller. Don't use this
   while (!non_blocking && rc == 0 && msgq_do_exit == 0){
@@ -119,7 +134,7 @@ Message * MSGQSubSocket::receive(bool non_blocking){
     int t = (timeout != -1) ? timeout : 100;
 
     int n = msgq_poll(items, 1, t);
-    rc = msgq_msg_recv(&msg, q);
+    rc = recv(&msg, q);
 
     // The poll indicated a message was ready, but the receive failed. Try again
     if (n == 1 && rc == 0){
@@ -141,20 +156,32 @@ Message * MSGQSubSocket::receive(bool non_blocking){
 
   if (rc > 0){
     if (msgq_do_exit){
-      msgq_msg_close(&msg); // Free unused message on exit
+      if (!lease) msgq_msg_close(&msg); // Free unused message on exit
     } else {
       r = new MSGQMessage;
-      r->takeOwnership(msg.data, msg.size);
+      lease ? r->borrow(msg.data, msg.size) : r->takeOwnership(msg.data, msg.size);
     }
   }
 
   return (Message*)r;
 }
 
+bool MSGQSubSocket::lease_valid(){
+  return msgq_msg_lease_valid(q);
+}
+
+void MSGQSubSocket::release_lease(){
+  msgq_msg_release(q);
+}
+
 void MSGQSubSocket::setTimeout(int t){
   timeout = t;
 }
 
+size_t MSGQSubSocket::rewind(size_t n){
+  return msgq_rewind_reader(q, n);
+}
+
 MSGQSubSocket::~MSGQSubSocket(){
   if (q != NULL){
     msgq_close_queue(q);
@@ -175,7 +202,11 @@ int MSGQPubSocket::connect(Context *context, std::string endpoint, bool check_en
     return r;
   }
 
-  msgq_init_publisher(q);
+  if (is_multi_publisher(endpoint)){
+    msgq_init_multi_publisher(q);
+  } else {
+    msgq_init_publisher(q);
+  }
 
   return 0;
 }
@@ -196,10 +227,27 @@ int MSGQPubSocket::send(char *data, size_t size){
   return msgq_msg_send(&msg, q);
 }
 
+char *MSGQPubSocket::reserve(size_t size){
+  reserved.size = size;
+  if (msgq_msg_reserve(&reserved, q) < 0){
+    return NULL;
+  }
+  return reserved.data;
+}
+
+int MSGQPubSocket::commit(size_t size){
+  reserved.size = size;
+  return msgq_msg_commit(&reserved, q);
+}
+
 bool MSGQPubSocket::all_readers_updated() {
   return msgq_all_readers_updated(q);
 }
 
+bool MSGQPubSocket::wait_readers_updated(int timeout_ms) {
+  return msgq_wait_readers_updated(q, timeout_ms);
+}
+
 MSGQPubSocket::~MSGQPubSocket(){
   if (q != NULL){
     msgq_close_queue(q);
@@ -19,10 +19,12 @@ class MSGQMessage : public Message {
 private:
   char * data;
   size_t size;
+  bool owner = true;
 public:
   void init(size_t size);
   void init(char *data, size_t size);
   void takeOwnership(char *data, size_t size);
+  void borrow(char *data, size_t size);
   size_t getSize(){return size;}
   char * getData(){return data;}
   void close();
@@ -33,22 +35,31 @@ class MSGQSubSocket : public SubSocket {
 private:
   msgq_queue_t * q = NULL;
   int timeout;
+  Message *receive(bool non_blocking, bool lease);
 public:
   int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true);
   void setTimeout(int timeout);
   void * getRawSocket() {return (void*)q;}
-  Message *receive(bool non_blocking=false);
+  Message *receive(bool non_blocking=false) {return receive(non_blocking, false);}
+  Message *receive_lease(bool non_blocking=false) {return receive(non_blocking, true);}
+  bool lease_valid();
+  void release_lease();
+  size_t rewind(size_t n);
   ~MSGQSubSocket();
 };
 
 class MSGQPubSocket : public PubSocket {
 private:
   msgq_queue_t * q = NULL;
+  msgq_msg_t reserved;
 public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  char *reserve(size_t size);
+  int commit(size_t size);
   bool all_readers_updated();
+  bool wait_readers_updated(int timeout_ms = -1);
   ~MSGQPubSocket();
 };
 
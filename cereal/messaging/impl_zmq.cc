@@ -131,8 +131,24 @@ int ZMQPubSocket::send(char *data, size_t size){
   return zmq_send(sock, data, size, ZMQ_DONTWAIT);
 }
 
+char *ZMQPubSocket::reserve(size_t size){
+  reserved.resize(size);
+  return reserved.data();
+}
+
+int ZMQPubSocket::commit(size_t size){
+  assert(size <= reserved.size());
+  return zmq_send(sock, reserved.data(), size, ZMQ_DONTWAIT);
+}
+
+// ZMQ doesn't tell the publisher what its subscribers have received, so there is no lockstep
 bool ZMQPubSocket::all_readers_updated() {
-  assert(false); // TODO not implemented
+  std::cerr << "all_readers_updated is not supported with ZMQ" << std::endl;
+  return false;
+}
+
+bool ZMQPubSocket::wait_readers_updated(int timeout_ms) {
+  std::cerr << "wait_readers_updated is not supported with ZMQ" << std::endl;
   return false;
 }
 
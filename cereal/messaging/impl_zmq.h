@@ -2,6 +2,7 @@
 #include "messaging.h"
 #include <zmq.h>
 #include <string>
+#include <vector>
 
 #define MAX_POLLERS 128
 
@@ -43,11 +44,15 @@ class ZMQPubSocket : public PubSocket {
 private:
   void * sock;
   std::string full_endpoint;
+  std::vector<char> reserved;
 public:
   int connect(Context *context, std::string endpoint, bool check_endpoint=true);
   int sendMessage(Message *message);
   int send(char *data, size_t size);
+  char *reserve(size_t size);
+  int commit(size_t size);
   bool all_readers_updated();
+  bool wait_readers_updated(int timeout_ms = -1);
   ~ZMQPubSocket();
 };
 
@@ -1,10 +1,21 @@
 #pragma once
+#include <cassert>
 #include <cstddef>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
 #include <string>
+#include <stdexcept>
 #include <vector>
+#include <array>
+#include <condition_variable>
 #include <capnp/serialize.h>
 #include "../gen/cpp/log.capnp.h"
+#include "../services.h"
+#include "sim_clock.h"
 
 #ifdef __APPLE__
 #define CLOCK_BOOTTIME CLOCK_MONOTONIC
@@ -37,6 +48,15 @@ public:
   virtual int connect(Context *context, std::string endpoint, std::string address, bool conflate=false, bool check_endpoint=true) = 0;
   virtual void setTimeout(int timeout) = 0;
   virtual Message *receive(bool non_blocking=false) = 0;
+  // Zero-copy receive, the message may point into a shared buffer and is only kept
+  // in place until release_lease() or the next receive on this socket. Check lease_valid() after reading.
+  virtual Message *receive_lease(bool non_blocking=false) { return receive(non_blocking); }
+  virtual bool lease_valid() { return true; }
+  // Lets the publisher know the leased message was read, until then the reader counts as behind
+  virtual void release_lease() {}
+  // Replay up to the last n messages that are still buffered, call before the first receive.
+  // Returns the number of messages that will be replayed, backends without history return 0.
+  virtual size_t rewind(size_t n) { return 0; }
   virtual void * getRawSocket() = 0;
   static SubSocket * create();
   static SubSocket * create(Context * context, std::string endpoint, std::string address="127.0.0.1", bool conflate=false, bool check_endpoint=true);
@@ -48,7 +68,13 @@ public:
   virtual int connect(Context *context, std::string endpoint, bool check_endpoint=true) = 0;
   virtual int sendMessage(Message *message) = 0;
   virtual int send(char *data, size_t size) = 0;
+  // Zero-copy publish, write up to size bytes into the returned buffer and commit the used size
+  virtual char *reserve(size_t size) = 0;
+  virtual int commit(size_t size) = 0;
   virtual bool all_readers_updated() = 0;
+  // Lock-step publishing, blocks until every subscriber has consumed all messages.
+  // Returns false on timeout, true right away when nobody is subscribed.
+  virtual bool wait_readers_updated(int timeout_ms = -1) = 0;
   static PubSocket * create();
   static PubSocket * create(Context * context, std::string endpoint, bool check_endpoint=true);
   static PubSocket * create(Context * context, std::string endpoint, int port, bool check_endpoint=true);
@@ -64,11 +90,81 @@ public:
   virtual ~Poller(){};
 };
 
+// Zero-copy read of the next message on sock. The data stays in the publisher's ring, so fn has to
+// copy out everything it needs. Overwrites are detected after fn returns, the lease is released then.
+// Returns 1 if fn read a valid message, 0 if there was none and -1 if it was torn or overwritten
+// while fn read it, in which case whatever fn extracted has to be discarded.
+int receive_leased(SubSocket *sock, const std::function<void(cereal::Event::Reader &)> &fn, bool non_blocking = true);
+
+class AlignedBuffer {
+public:
+  kj::ArrayPtr<const capnp::word> align(const char *data, const size_t size) {
+    words_size = size / sizeof(capnp::word) + 1;
+    if (aligned_buf.size() < words_size) {
+      aligned_buf = kj::heapArray<capnp::word>(words_size < 512 ? 512 : words_size);
+    }
+    memcpy(aligned_buf.begin(), data, size);
+    return aligned_buf.slice(0, words_size);
+  }
+  inline kj::ArrayPtr<const capnp::word> align(Message *m) {
+    return align(m->getData(), m->getSize());
+  }
+private:
+  kj::Array<capnp::word> aligned_buf;
+  size_t words_size;
+};
+
+// Decoded message, shared by the SubMasters of a SubHub and buffered by MergeReceiver
+struct HubEvent {
+  HubEvent(Message *msg, uint64_t seq);
+  ~HubEvent() { delete msg; }
+  Message *msg;
+  AlignedBuffer aligned_buf;
+  capnp::FlatArrayMessageReader reader;
+  cereal::Event::Reader event;
+  uint64_t seq;
+};
+
+// Per-process fan-out for SubMasters. The hub owns one conflating socket per service,
+// so every SubMaster of the process shares a single reader slot and decoded event.
+// One SubMaster polls at a time without holding the lock, SubMasters on other threads
+// wait for it to publish the received events.
+class SubHub {
+public:
+  static SubHub &instance();
+  ~SubHub();
+
+private:
+  friend class SubMaster;
+  void subscribe(int service, const char *address);
+  // Receive until one of services has an event newer than seq or the timeout expires.
+  // Fills events with the newest event of each service and returns the latest seq.
+  uint64_t update(const std::vector<int> &services, uint64_t seq, int timeout,
+                  std::vector<std::shared_ptr<const HubEvent>> &events);
+
+  std::mutex lock_;
+  std::condition_variable cv_;
+  bool polling_ = false;
+  Poller *poller_ = nullptr;
+  std::map<SubSocket *, int> sockets_;
+  std::array<SubSocket *, NUM_SERVICES> service_sockets_ = {};
+  std::array<std::shared_ptr<const HubEvent>, NUM_SERVICES> latest_ = {};
+  uint64_t seq_ = 0;
+};
+
 class SubMaster {
 public:
-  SubMaster(const std::vector<const char *> &service_list,
-            const char *address = nullptr, const std::vector<const char *> &ignore_alive = {});
+  // Services in replay start from their last published message instead of waiting for the next one
+  SubMaster(const std::vector<const char *> &service_list, const char *address = nullptr,
+            const std::vector<const char *> &ignore_alive = {}, const std::vector<const char *> &replay = {});
+  SubMaster(const std::vector<ServiceId> &service_list, const char *address = nullptr,
+            const std::vector<ServiceId> &ignore_alive = {}, const std::vector<ServiceId> &replay = {});
+  // Receive through a hub shared with the other SubMasters of the process
+  SubMaster(SubHub &hub, const std::vector<const char *> &service_list, const std::vector<const char *> &ignore_alive = {});
   void update(int timeout = 1000);
+  // Also return from update when sock has a message, e.g. the notification socket of a VisionIpcClient.
+  // The socket isn't read, its owner has to receive from it after update.
+  void register_wake(SubSocket *sock);
   void update_msgs(uint64_t current_time, const std::vector<std::pair<std::string, cereal::Event::Reader>> &messages);
   inline bool allAlive(const std::vector<const char *> &service_list = {}) { return all_(service_list, false, true); }
   inline bool allValid(const std::vector<const char *> &service_list = {}) { return all_(service_list, true, false); }
@@ -77,6 +173,14 @@ public:
   ~SubMaster();
 
   uint64_t frame = 0;
+  inline bool updated(ServiceId id) const { return at(id)->updated; }
+  inline bool alive(ServiceId id) const { return at(id)->alive; }
+  inline bool valid(ServiceId id) const { return at(id)->valid; }
+  inline uint64_t rcv_frame(ServiceId id) const { return at(id)->rcv_frame; }
+  inline uint64_t rcv_time(ServiceId id) const { return at(id)->rcv_time; }
+  inline cereal::Event::Reader &operator[](ServiceId id) const { return at(id)->event; }
+
+  // String lookups, prefer the ServiceId overloads in hot loops
   bool updated(const char *name) const;
   bool alive(const char *name) const;
   bool valid(const char *name) const;
@@ -85,11 +189,79 @@ public:
   cereal::Event::Reader &operator[](const char *name) const;
 
 private:
+  friend class MergeReceiver;
+  // Only tracks the messages passed to update_msgs
+  SubMaster(const std::vector<const char *> &service_list, const std::vector<const char *> &ignore_alive, std::nullptr_t);
+
+  struct SubMessage {
+    std::string name;
+    SubSocket *socket = nullptr;
+    int freq = 0;
+    bool updated = false, alive = false, valid = true, ignore_alive;
+    uint64_t rcv_time = 0, rcv_frame = 0;
+    void *allocated_msg_reader = nullptr;
+    capnp::FlatArrayMessageReader *msg_reader = nullptr;
+    Message *msg = nullptr; // message backing event, kept until the next receive
+    std::shared_ptr<const HubEvent> hub_event; // backs event when receiving through a hub
+    uint64_t hub_seq = 0;
+    AlignedBuffer aligned_buf;
+    cereal::Event::Reader event;
+  };
+
+  inline SubMessage *at(ServiceId id) const {
+    SubMessage *m = services_[static_cast<int>(id)];
+    if (m == nullptr) throw std::out_of_range("service not subscribed");
+    return m;
+  }
+  SubMessage *at(const char *name) const;
   bool all_(const std::vector<const char *> &service_list, bool valid, bool alive);
+  void update_msgs_(uint64_t current_time, const std::vector<SubMessage *> &messages);
+  void update_hub_(int timeout);
   Poller *poller_ = nullptr;
-  struct SubMessage;
-  std::map<SubSocket *, SubMessage *> messages_;
-  std::map<std::string, SubMessage *> services_;
+  SubHub *hub_ = nullptr;
+  std::vector<int> hub_services_;
+  uint64_t hub_seq_ = 0;
+  std::vector<SubMessage *> messages_;
+  std::map<SubSocket *, SubMessage *> sockets_;
+  std::set<SubSocket *> wake_sockets_;
+  std::array<SubMessage *, NUM_SERVICES> services_ = {};
+};
+
+// Receives every message of several services and hands them out in logMonoTime order.
+// A message is held back until one at least reorder_window_ns newer arrives, or for
+// reorder_window_ns at most, so late messages within the window are put in place.
+// It goes out early once every service publishing at least once per window has sent
+// a message as new, since nothing older can follow from those.
+class MergeReceiver {
+public:
+  MergeReceiver(const std::vector<const char *> &service_list, uint64_t reorder_window_ns,
+                const std::vector<const char *> &ignore_alive = {}, const char *address = nullptr);
+  // Waits up to timeout ms for new messages and returns the ones leaving the reorder window.
+  // Readers are valid until the next call, status is updated with them like SubMaster::update.
+  const std::vector<std::pair<std::string, cereal::Event::Reader>> &receive(int timeout = 1000);
+  ~MergeReceiver();
+
+  SubMaster status;
+
+private:
+  struct Pending {
+    uint64_t mono_time, seq, rcv_time;
+    int service;
+    std::shared_ptr<const HubEvent> event;
+    bool operator>(const Pending &other) const {
+      return mono_time != other.mono_time ? mono_time > other.mono_time : seq > other.seq;
+    }
+  };
+
+  uint64_t window_;
+  uint64_t newest_ = 0, seq_ = 0;
+  // Newest logMonoTime of the services waited on for early release
+  std::map<int, uint64_t> latest_;
+  Poller *poller_ = nullptr;
+  std::map<SubSocket *, int> sockets_;
+  std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>> pending_;
+  std::vector<std::shared_ptr<const HubEvent>> released_;
+  std::vector<std::pair<std::string, cereal::Event::Reader>> events_;
 };
 
 class MessageBuilder : public capnp::MallocMessageBuilder {
@@ -98,10 +270,7 @@ public:
 
   cereal::Event::Builder initEvent(bool valid = true) {
     cereal::Event::Builder event = initRoot<cereal::Event>();
-    struct timespec t;
-    clock_gettime(CLOCK_BOOTTIME, &t);
-    uint64_t current_time = t.tv_sec * 1000000000ULL + t.tv_nsec;
-    event.setLogMonoTime(current_time);
+    event.setLogMonoTime(sim_clock_nanos_since_boot());
     event.setValid(valid);
     return event;
   }
@@ -118,28 +287,20 @@ private:
 class PubMaster {
 public:
   PubMaster(const std::vector<const char *> &service_list);
-  inline int send(const char *name, capnp::byte *data, size_t size) { return sockets_.at(name)->send((char *)data, size); }
+  PubMaster(const std::vector<ServiceId> &service_list);
+  inline int send(ServiceId id, capnp::byte *data, size_t size) { return at(id)->send((char *)data, size); }
+  int send(ServiceId id, MessageBuilder &msg);
+  int send(const char *name, capnp::byte *data, size_t size);
   int send(const char *name, MessageBuilder &msg);
+  inline bool wait_readers_updated(ServiceId id, int timeout_ms = -1) { return at(id)->wait_readers_updated(timeout_ms); }
+  bool wait_readers_updated(const char *name, int timeout_ms = -1);
   ~PubMaster();
 
 private:
-  std::map<std::string, PubSocket *> sockets_;
-};
-
-class AlignedBuffer {
-public:
-  kj::ArrayPtr<const capnp::word> align(const char *data, const size_t size) {
-    words_size = size / sizeof(capnp::word) + 1;
-    if (aligned_buf.size() < words_size) {
-      aligned_buf = kj::heapArray<capnp::word>(words_size < 512 ? 512 : words_size);
-    }
-    memcpy(aligned_buf.begin(), data, size);
-    return aligned_buf.slice(0, words_size);
-  }
-  inline kj::ArrayPtr<const capnp::word> align(Message *m) {
-    return align(m->getData(), m->getSize());
+  inline PubSocket *at(ServiceId id) const {
+    PubSocket *s = sockets_[static_cast<int>(id)];
+    if (s == nullptr) throw std::out_of_range("service not published");
+    return s;
   }
-private:
-  kj::Array<capnp::word> aligned_buf;
-  size_t words_size;
+  std::array<PubSocket *, NUM_SERVICES> sockets_ = {};
 };
@@ -24,6 +24,7 @@ cdef extern from "messaging.h":
     int connect(Context *, string, string, bool)
     Message * receive(bool)
     void setTimeout(int)
+    size_t rewind(size_t)
 
   cdef cppclass PubSocket:
     @staticmethod
@@ -32,6 +33,7 @@ cdef extern from "messaging.h":
     int sendMessage(Message *)
     int send(char *, size_t)
     bool all_readers_updated()
+    bool wait_readers_updated(int) nogil
 
   cdef cppclass Poller:
     @staticmethod
@@ -0,0 +1,346 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "impl_msgq.h"
+#include "impl_zmq.h"
+
+// Benchmarks the msgq and ZMQ backends. Every case prints one JSON object per line on stdout.
+//
+// pubsub: one publisher, N readers. The throughput phase publishes as fast as possible, so its
+//         latency includes queueing, the latency phase publishes at a fixed rate.
+// fanin:  FANIN_SOCKETS publishers, one reader polling all of them with a Poller.
+// catchup: time for a conflating reader to get the newest message after falling behind by a backlog.
+//
+// usage: messaging_bench [--backend msgq,zmq] [--sizes 64,1024,...] [--readers 1,4,...]
+//                        [--conflate 0,1] [--duration s] [--rate hz] [--no-fanin] [--no-catchup]
+
+#define BENCH_ZMQ_PORT 51000
+#define FANIN_SOCKETS 40
+#define FANIN_SIZE 256
+#define CATCHUP_SIZE 64
+#define CATCHUP_ROUNDS 20
+
+static uint64_t now_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static uint64_t thread_cpu_ns() {
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+struct Backend {
+  std::string name;
+  bool zmq;
+
+  Context *context() const { return zmq ? (Context *)new ZMQContext() : (Context *)new MSGQContext(); }
+  PubSocket *pub() const { return zmq ? (PubSocket *)new ZMQPubSocket() : (PubSocket *)new MSGQPubSocket(); }
+  SubSocket *sub() const { return zmq ? (SubSocket *)new ZMQSubSocket() : (SubSocket *)new MSGQSubSocket(); }
+  Poller *poller() const { return zmq ? (Poller *)new ZMQPoller() : (Poller *)new MSGQPoller(); }
+
+  std::string endpoint(int i) const {
+    return zmq ? std::to_string(BENCH_ZMQ_PORT + i) : "messaging_bench_" + std::to_string(i);
+  }
+  void cleanup(int i) const {
+    if (!zmq) unlink((msgq_shm_dir() + "/" + endpoint(i)).c_str());
+  }
+};
+
+struct ReaderResult {
+  uint64_t received = 0;
+  uint64_t cpu_ns = 0;
+  std::vector<uint32_t> latency_ns;
+};
+
+struct Result {
+  uint64_t sent = 0;
+  double seconds = 0;
+  uint64_t pub_cpu_ns = 0;
+  std::vector<ReaderResult> readers;
+};
+
+static void reader_loop(std::vector<SubSocket *> socks, Poller *poller, std::atomic<bool> *done, ReaderResult *result) {
+  uint64_t cpu_start = thread_cpu_ns();
+  while (true) {
+    std::vector<SubSocket *> ready = poller ? poller->poll(100) : socks;
+    bool got_any = false;
+    for (auto sock : ready) {
+      Message *msg = sock->receive(poller != nullptr);
+      if (msg == NULL) continue;
+
+      got_any = true;
+      result->received++;
+      if (msg->getSize() >= sizeof(uint64_t)) {
+        uint64_t sent;
+        memcpy(&sent, msg->getData(), sizeof(sent));
+        result->latency_ns.push_back(std::min(now_ns() - sent, (uint64_t)UINT32_MAX));
+      }
+      delete msg;
+    }
+    if (!got_any && done->load()) break;
+  }
+  result->cpu_ns = thread_cpu_ns() - cpu_start;
+}
+
+// Publishes round robin over socks, flat out when rate is 0
+static void publish(std::vector<PubSocket *> &socks, size_t size, double duration, double rate, Result *result) {
+  std::vector<char> buf(size, 0x55);
+  uint64_t cpu_start = thread_cpu_ns();
+  uint64_t start = now_ns();
+  uint64_t end = start + duration * 1e9;
+  uint64_t interval = rate > 0 ? 1e9 / rate : 0;
+
+  for (uint64_t i = 0;; i++) {
+    uint64_t t = now_ns();
+    if (t >= end) break;
+    if (interval) {
+      uint64_t next = start + i * interval;
+      if (next > t) std::this_thread::sleep_for(std::chrono::nanoseconds(next - t));
+      t = now_ns();
+    }
+
+    memcpy(buf.data(), &t, sizeof(t));
+    socks[i % socks.size()]->send(buf.data(), buf.size());
+    result->sent++;
+  }
+  result->seconds = (now_ns() - start) / 1e9;
+  result->pub_cpu_ns = thread_cpu_ns() - cpu_start;
+}
+
+static Result run_case(const Backend &backend, size_t size, int num_readers, bool conflate, int num_pubs,
+                       double duration, double rate) {
+  Context *ctx = backend.context();
+  std::vector<PubSocket *> pubs;
+  for (int i = 0; i < num_pubs; i++) {
+    backend.cleanup(i);
+    PubSocket *pub = backend.pub();
+    int r = pub->connect(ctx, backend.endpoint(i), false);
+    assert(r == 0);
+    pubs.push_back(pub);
+  }
+
+  // Fan-in uses a single reader polling every publisher, pubsub one socket per reader
+  std::vector<std::vector<SubSocket *>> socks(num_readers);
+  std::vector<Poller *> pollers(num_readers, nullptr);
+  for (int r = 0; r < num_readers; r++) {
+    for (int i = 0; i < num_pubs; i++) {
+      SubSocket *sub = backend.sub();
+      int ret = sub->connect(ctx, backend.endpoint(i), "127.0.0.1", conflate, false);
+      assert(ret == 0);
+      sub->setTimeout(100);
+      socks[r].push_back(sub);
+    }
+    if (num_pubs > 1) pollers[r] = backend.poller();
+    for (auto sub : socks[r]) {
+      if (pollers[r]) pollers[r]->registerSocket(sub);
+    }
+  }
+
+  // ZMQ subscribers need a moment to finish connecting
+  if (backend.zmq) std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+  Result result;
+  result.readers.resize(num_readers);
+  std::atomic<bool> done = false;
+  std::vector<std::thread> threads;
+  for (int r = 0; r < num_readers; r++) {
+    threads.emplace_back(reader_loop, socks[r], pollers[r], &done, &result.readers[r]);
+  }
+
+  publish(pubs, size, duration, rate, &result);
+  done = true;
+  for (auto &t : threads) t.join();
+
+  for (int r = 0; r < num_readers; r++) {
+    for (auto sub : socks[r]) delete sub;
+    delete pollers[r];
+  }
+  for (int i = 0; i < num_pubs; i++) {
+    delete pubs[i];
+    backend.cleanup(i);
+  }
+  delete ctx;
+  return result;
+}
+
+static double percentile_us(std::vector<uint32_t> &v, double pct) {
+  if (v.empty()) return 0;
+  size_t idx = std::min((size_t)(v.size() * pct), v.size() - 1);
+  std::nth_element(v.begin(), v.begin() + idx, v.end());
+  return v[idx] / 1e3;
+}
+
+static void print_result(const char *bench, const Backend &backend, size_t size, int num_readers, bool conflate,
+                         int num_pubs, const char *phase, double rate, Result &res) {
+  uint64_t received = 0, sub_cpu_ns = 0;
+  std::vector<uint32_t> latency;
+  for (auto &r : res.readers) {
+    received += r.received;
+    sub_cpu_ns += r.cpu_ns;
+    latency.insert(latency.end(), r.latency_ns.begin(), r.latency_ns.end());
+  }
+
+  double recv_rate = received / res.seconds / res.readers.size();
+  char line[1024];
+  snprintf(line, sizeof(line),
+           "{\"bench\": \"%s\", \"backend\": \"%s\", \"size\": %zu, \"readers\": %d, \"publishers\": %d, "
+           "\"conflate\": %s, \"phase\": \"%s\", \"rate\": %.0f, \"seconds\": %.3f, \"sent\": %lu, \"received\": %lu, "
+           "\"sent_per_s\": %.1f, \"received_per_s_per_reader\": %.1f, \"mb_per_s_per_reader\": %.2f, "
+           "\"pub_cpu_us_per_msg\": %.3f, \"sub_cpu_us_per_msg\": %.3f, "
+           "\"latency_p50_us\": %.1f, \"latency_p99_us\": %.1f, \"latency_p999_us\": %.1f}",
+           bench, backend.name.c_str(), size, num_readers, num_pubs, conflate ? "true" : "false", phase, rate,
+           res.seconds, (unsigned long)res.sent, (unsigned long)received, res.sent / res.seconds, recv_rate,
+           recv_rate * size / (1024. * 1024.), res.sent ? res.pub_cpu_ns / 1e3 / res.sent : 0.,
+           received ? sub_cpu_ns / 1e3 / received : 0., percentile_us(latency, 0.5), percentile_us(latency, 0.99),
+           percentile_us(latency, 0.999));
+  std::cout << line << std::endl;
+}
+
+static void run_catchup(const Backend &backend, int backlog) {
+  Context *ctx = backend.context();
+  backend.cleanup(0);
+  PubSocket *pub = backend.pub();
+  int r = pub->connect(ctx, backend.endpoint(0), false);
+  assert(r == 0);
+  SubSocket *sub = backend.sub();
+  r = sub->connect(ctx, backend.endpoint(0), "127.0.0.1", true, false);
+  assert(r == 0);
+  sub->setTimeout(100);
+  if (backend.zmq) std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+  std::vector<char> buf(CATCHUP_SIZE, 0x55);
+  std::vector<uint32_t> recv_ns;
+  int missed = 0;
+  for (int round = 0; round < CATCHUP_ROUNDS; round++) {
+    for (int i = 0; i < backlog; i++) {
+      uint64_t idx = i;
+      memcpy(buf.data(), &idx, sizeof(idx));
+      pub->send(buf.data(), buf.size());
+    }
+    // Give ZMQ time to move the messages into the subscriber
+    if (backend.zmq) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+    uint64_t start = now_ns();
+    Message *msg = sub->receive();
+    recv_ns.push_back(now_ns() - start);
+
+    uint64_t idx = 0;
+    if (msg != NULL) memcpy(&idx, msg->getData(), sizeof(idx));
+    missed += (msg == NULL || idx != (uint64_t)backlog - 1);
+    delete msg;
+  }
+
+  delete sub;
+  delete pub;
+  backend.cleanup(0);
+  delete ctx;
+
+  char line[512];
+  snprintf(line, sizeof(line),
+           "{\"bench\": \"catchup\", \"backend\": \"%s\", \"size\": %d, \"backlog\": %d, \"rounds\": %d, "
+           "\"not_newest\": %d, \"recv_p50_us\": %.2f, \"recv_max_us\": %.2f}",
+           backend.name.c_str(), CATCHUP_SIZE, backlog, CATCHUP_ROUNDS, missed, percentile_us(recv_ns, 0.5),
+           percentile_us(recv_ns, 1.0));
+  std::cout << line << std::endl;
+}
+
+static std::vector<std::string> split(const std::string &s) {
+  std::vector<std::string> out;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    if (!item.empty()) out.push_back(item);
+  }
+  return out;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> backend_names = {"msgq", "zmq"};
+  std::vector<size_t> sizes = {64, 1024, 16 * 1024, 256 * 1024, 2 * 1024 * 1024};
+  std::vector<int> readers = {1, 4, 10, 16, 48};
+  std::vector<bool> conflates = {false, true};
+  double duration = 1.0, rate = 1000.0;
+  bool fanin = true, catchup = true;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    std::string val = (i + 1 < argc) ? argv[i + 1] : "";
+    if (arg == "--no-fanin") {
+      fanin = false;
+      continue;
+    } else if (arg == "--no-catchup") {
+      catchup = false;
+      continue;
+    } else if (val.empty()) {
+      std::cerr << "missing value for " << arg << std::endl;
+      return 1;
+    }
+
+    if (arg == "--backend") {
+      backend_names = split(val);
+    } else if (arg == "--sizes") {
+      sizes.clear();
+      for (auto &s : split(val)) sizes.push_back(std::stoul(s));
+    } else if (arg == "--readers") {
+      readers.clear();
+      for (auto &s : split(val)) readers.push_back(std::stoi(s));
+    } else if (arg == "--conflate") {
+      conflates.clear();
+      for (auto &s : split(val)) conflates.push_back(s == "1");
+    } else if (arg == "--duration") {
+      duration = std::stod(val);
+    } else if (arg == "--rate") {
+      rate = std::stod(val);
+    } else {
+      std::cerr << "unknown argument " << arg << std::endl;
+      return 1;
+    }
+    i++;
+  }
+
+  for (auto &name : backend_names) {
+    assert(name == "msgq" || name == "zmq");
+    Backend backend = {name, name == "zmq"};
+
+    for (size_t size : sizes) {
+      for (int num_readers : readers) {
+        for (bool conflate : conflates) {
+          Result throughput = run_case(backend, size, num_readers, conflate, 1, duration, 0);
+          print_result("pubsub", backend, size, num_readers, conflate, 1, "throughput", 0, throughput);
+          Result latency = run_case(backend, size, num_readers, conflate, 1, duration, rate);
+          print_result("pubsub", backend, size, num_readers, conflate, 1, "latency", rate, latency);
+        }
+      }
+    }
+
+    if (fanin) {
+      Result throughput = run_case(backend, FANIN_SIZE, 1, false, FANIN_SOCKETS, duration, 0);
+      print_result("fanin", backend, FANIN_SIZE, 1, false, FANIN_SOCKETS, "throughput", 0, throughput);
+      Result latency = run_case(backend, FANIN_SIZE, 1, false, FANIN_SOCKETS, duration, rate);
+      print_result("fanin", backend, FANIN_SIZE, 1, false, FANIN_SOCKETS, "latency", rate, latency);
+    }
+
+    if (catchup) {
+      for (int backlog : {1, 10, 100, 1000, 10000}) {
+        run_catchup(backend, backlog);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -102,6 +102,9 @@ cdef class SubSocket:
   def setTimeout(self, int timeout):
     self.socket.setTimeout(timeout)
 
+  def rewind(self, size_t n):
+    return self.socket.rewind(n)
+
   def receive(self, bool non_blocking=False):
     msg = self.socket.receive(non_blocking)
 
@@ -147,8 +150,17 @@ cdef class PubSocket:
     if r != length:
       if errno.errno == errno.EADDRINUSE:
         raise MultiplePublishersError
+      elif errno.errno == errno.EMSGSIZE:
+        # Too large for the ring, logged and dropped
+        return
       else:
         raise MessagingError
 
   def all_readers_updated(self):
     return self.socket.all_readers_updated()
+
+  def wait_readers_updated(self, int timeout=-1):
+    cdef bool updated
+    with nogil:
+      updated = self.socket.wait_readers_updated(timeout)
+    return updated
@@ -5,8 +5,10 @@
 #include <cstring>
 #include <cstdint>
 #include <chrono>
+#include <thread>
 #include <algorithm>
 #include <cstdlib>
+#include <climits>
 #include <csignal>
 #include <random>
 
@@ -19,25 +21,88 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#endif
+
 #include <stdio.h>
 
 #include "msgq.h"
 
-void sigusr2_handler(int signal) {
-  assert(signal == SIGUSR2);
+// Every counter has a single writer, so a relaxed load and store avoids a locked add
+static inline void stat_add(uint64_t *counter, uint64_t value = 1){
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
 }
 
-uint64_t msgq_get_uid(void){
-  std::random_device rd("/dev/urandom");
-  std::uniform_int_distribution<uint64_t> distribution(0,std::numeric_limits<uint32_t>::max());
+static inline int log2_bucket(uint64_t value, int num_buckets){
+  int bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+  return std::min(bucket, num_buckets - 1);
+}
+
+static inline uint64_t msgq_now(void){
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
+static uint32_t msgq_gettid(void){
   #ifdef __APPLE__
-    // TODO: this doesn't work
-    uint64_t uid = distribution(rd) << 32 | getpid();
+    return getpid();
+  #else
+    return syscall(SYS_gettid);
+  #endif
+}
+
+static msgq_doorbell_t *msgq_doorbells(void){
+  static msgq_doorbell_t *doorbells = [](){
+    size_t size = NUM_DOORBELLS * sizeof(msgq_doorbell_t);
+    int fd = open("/dev/shm/msgq_doorbells", O_RDWR | O_CREAT, 0664);
+    assert(fd >= 0);
+
+    int rc = ftruncate(fd, size);
+    assert(rc == 0);
+
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    assert(mem != MAP_FAILED);
+    return (msgq_doorbell_t *)mem;
+  }();
+  return doorbells;
+}
+
+static inline std::atomic<uint32_t> *doorbell_seq(uint64_t idx){
+  return reinterpret_cast<std::atomic<uint32_t>*>(&msgq_doorbells()[idx % NUM_DOORBELLS].seq);
+}
+
+static inline std::atomic<uint32_t> *doorbell_waiters(uint64_t idx){
+  return reinterpret_cast<std::atomic<uint32_t>*>(&msgq_doorbells()[idx % NUM_DOORBELLS].waiters);
+}
+
+static void doorbell_ring(uint64_t idx){
+  doorbell_seq(idx)->fetch_add(1);
+
+  // Skip the syscall if nobody is sleeping on this doorbell
+  if (*doorbell_waiters(idx) == 0) return;
+
+  #ifdef __linux__
+    syscall(SYS_futex, doorbell_seq(idx), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  #endif
+}
+
+// Sleep until the doorbell moves away from seq or the timeout expires
+static void doorbell_wait(uint64_t idx, uint32_t seq, const struct timespec *ts){
+  #ifdef __linux__
+    syscall(SYS_futex, doorbell_seq(idx), FUTEX_WAIT, seq, ts, NULL, 0);
   #else
-    uint64_t uid = distribution(rd) << 32 | syscall(SYS_gettid);
+    // No futex, fall back to polling
+    struct timespec poll_ts = {0, 10 * 1000 * 1000};
+    nanosleep((ts == NULL || ts->tv_sec > 0 || ts->tv_nsec > poll_ts.tv_nsec) ? &poll_ts : ts, NULL);
   #endif
+}
+
+uint64_t msgq_get_uid(void){
+  std::random_device rd("/dev/urandom");
+  std::uniform_int_distribution<uint64_t> distribution(0,std::numeric_limits<uint32_t>::max());
 
+  uint64_t uid = distribution(rd) << 32 | msgq_gettid();
   return uid;
 }
 
@@ -69,10 +134,51 @@ int msgq_msg_close(msgq_msg_t * msg){
 
 void msgq_reset_reader(msgq_queue_t * q){
   int id = q->reader_id;
+  q->lease_active = false;
   q->read_valids[id]->store(true);
   q->read_pointers[id]->store(*q->write_pointer);
 }
 
+// The writer invalidated us, count it and start over at the write pointer
+static void reader_lapped(msgq_queue_t * q){
+  stat_add(&q->stats->readers[q->reader_id].invalidations);
+  msgq_reset_reader(q);
+}
+
+// Move the read pointer back to the n-th newest message that is still in the ring,
+// so a late subscriber gets recent history instead of waiting for the next message.
+// Returns the number of messages that will be replayed, which can be less than n.
+size_t msgq_rewind_reader(msgq_queue_t * q, size_t n){
+  int id = q->reader_id;
+  assert(id >= 0);
+  msgq_msg_release(q);
+
+  uint64_t count = *q->history_count;
+  n = std::min({n, (size_t)count, (size_t)MSGQ_HISTORY_SIZE - 1});
+
+  for (; n > 0; n--){
+    uint64_t start = *q->history[(count - n) % MSGQ_HISTORY_SIZE];
+
+    // Once we point at the message the writer invalidates us before overwriting it,
+    // but it could already be writing there. Leave room for a full in flight message.
+    q->read_valids[id]->store(true);
+    q->read_pointers[id]->store(start);
+
+    uint32_t read_cycles, read_pointer;
+    UNPACK64(read_cycles, read_pointer, start);
+    uint32_t write_cycles, write_pointer;
+    UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+    uint64_t distance = (uint64_t)(write_cycles - read_cycles) * q->size + write_pointer - read_pointer;
+    if (write_cycles - read_cycles <= 1 && distance <= 2 * q->size / 3 && *q->read_valids[id]){
+      return n;
+    }
+  }
+
+  msgq_reset_reader(q);
+  return 0;
+}
+
 void msgq_wait_for_subscriber(msgq_queue_t *q){
   while (*q->num_readers == 0){
     ;
@@ -82,22 +188,36 @@ void msgq_wait_for_subscriber(msgq_queue_t *q){
 }
 
 
+std::string msgq_shm_dir(void){
+  const char *prefix = getenv(MSGQ_PREFIX_ENV);
+  if (prefix == NULL || prefix[0] == '\0'){
+    return "/dev/shm";
+  }
+  return std::string("/dev/shm/") + prefix;
+}
+
+void msgq_set_prefix(const char *prefix){
+  if (prefix == NULL || prefix[0] == '\0'){
+    unsetenv(MSGQ_PREFIX_ENV);
+  } else {
+    setenv(MSGQ_PREFIX_ENV, prefix, 1);
+  }
+}
+
 int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   assert(size < 0xFFFFFFFF); // Buffer must be smaller than 2^32 bytes
-  std::signal(SIGUSR2, sigusr2_handler);
 
-  const char * prefix = "/dev/shm/";
-  char * full_path = new char[strlen(path) + strlen(prefix) + 1];
-  strcpy(full_path, prefix);
-  strcat(full_path, path);
+  std::string dir = msgq_shm_dir();
+  if (dir != "/dev/shm"){
+    mkdir(dir.c_str(), 0775);
+  }
+  std::string full_path = dir + "/" + path;
 
-  auto fd = open(full_path, O_RDWR | O_CREAT, 0664);
+  auto fd = open(full_path.c_str(), O_RDWR | O_CREAT, 0664);
   if (fd < 0) {
     std::cout << "Warning, could not open: " << full_path << std::endl;
-    delete[] full_path;
     return -1;
   }
-  delete[] full_path;
 
   int rc = ftruncate(fd, size + sizeof(msgq_header_t));
   if (rc < 0){
@@ -112,22 +232,46 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
   }
   q->mmap_p = mem;
 
+#ifdef MADV_HUGEPAGE
+  // Opt-in transparent huge pages for large rings, needs shmem_enabled=advise in
+  // /sys/kernel/mm/transparent_hugepage. Only a hint, so failures are ignored.
+  static const bool use_hugepages = getenv("MSGQ_HUGEPAGES") != NULL;
+  if (use_hugepages && size >= MSGQ_HUGEPAGE_MIN_SIZE){
+    madvise(mem, size + sizeof(msgq_header_t), MADV_HUGEPAGE);
+  }
+#endif
+
   msgq_header_t *header = (msgq_header_t *)mem;
 
   // Setup pointers to header segment
   q->num_readers = reinterpret_cast<std::atomic<uint64_t>*>(&header->num_readers);
   q->write_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_pointer);
   q->write_uid = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_uid);
+  q->multi_publisher = reinterpret_cast<std::atomic<uint64_t>*>(&header->multi_publisher);
+  q->write_reserve_pointer = reinterpret_cast<std::atomic<uint64_t>*>(&header->write_reserve_pointer);
 
   for (size_t i = 0; i < NUM_READERS; i++){
     q->read_pointers[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pointers[i]);
     q->read_valids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_valids[i]);
     q->read_uids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_uids[i]);
+    q->read_pids[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_pids[i]);
+    q->read_doorbells[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->read_doorbells[i]);
+  }
+  for (size_t i = 0; i < MSGQ_HISTORY_SIZE; i++){
+    q->history[i] = reinterpret_cast<std::atomic<uint64_t>*>(&header->history[i]);
   }
+  q->history_count = reinterpret_cast<std::atomic<uint64_t>*>(&header->history_count);
+  q->stats = &header->stats;
 
   q->data = mem + sizeof(msgq_header_t);
   q->size = size;
   q->reader_id = -1;
+  q->lease_active = false;
+  q->lease_read_pointer = 0;
+  q->write_reserved_size = 0;
+  q->multi_publisher_local = false;
+  q->write_reserved_start = 0;
+  q->write_reserved_end = 0;
 
   q->endpoint = path;
   q->read_conflate = false;
@@ -137,33 +281,108 @@ int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size){
 
 void msgq_close_queue(msgq_queue_t *q){
   if (q->mmap_p != NULL){
+    // Release our reader slot so the next subscriber can reuse it
+    if (q->reader_id >= 0){
+      uint64_t uid = q->read_uid_local;
+      std::atomic_compare_exchange_strong(q->read_uids[q->reader_id], &uid, (uint64_t)0);
+    }
     munmap(q->mmap_p, q->size + sizeof(msgq_header_t));
   }
 }
 
 
+static void reset_readers(msgq_queue_t * q) {
+  *q->num_readers = 0;
+
+  for (size_t i = 0; i < NUM_READERS; i++){
+    *q->read_valids[i] = false;
+    *q->read_uids[i] = 0;
+    *q->read_pids[i] = 0;
+  }
+
+  memset(q->stats, 0, sizeof(msgq_stats_t));
+  q->stats->magic = MSGQ_STATS_MAGIC;
+}
+
 void msgq_init_publisher(msgq_queue_t * q) {
   //std::cout << "Starting publisher" << std::endl;
   uint64_t uid = msgq_get_uid();
 
   *q->write_uid = uid;
-  *q->num_readers = 0;
+  *q->multi_publisher = MSGQ_MULTI_PUBLISHER_OFF;
+  reset_readers(q);
 
-  for (size_t i = 0; i < NUM_READERS; i++){
-    *q->read_valids[i] = false;
-    *q->read_uids[i] = 0;
+  q->write_uid_local = uid;
+  q->multi_publisher_local = false;
+}
+
+// Join the queue as one of several publishers. The first one takes over the queue
+// like a single publisher would, the others keep the readers and write position.
+// Only the publisher that moves the flag out of MSGQ_MULTI_PUBLISHER_OFF initializes the
+// reserve pointer, the others wait for it to be ready before reserving.
+// A single publisher starting later takes the queue back, after which this one fails with EADDRINUSE.
+void msgq_init_multi_publisher(msgq_queue_t * q) {
+  uint64_t uid = msgq_get_uid();
+
+  uint64_t expected = MSGQ_MULTI_PUBLISHER_OFF;
+  if (std::atomic_compare_exchange_strong(q->multi_publisher, &expected, (uint64_t)MSGQ_MULTI_PUBLISHER_INIT)){
+    *q->write_reserve_pointer = (uint64_t)*q->write_pointer;
+    *q->write_uid = uid;
+    reset_readers(q);
+    *q->multi_publisher = MSGQ_MULTI_PUBLISHER_READY;
+  } else {
+    while (*q->multi_publisher == MSGQ_MULTI_PUBLISHER_INIT){
+      usleep(10);
+    }
   }
 
   q->write_uid_local = uid;
+  q->multi_publisher_local = true;
 }
 
-static void thread_signal(uint32_t tid) {
-  #ifndef SYS_tkill
-    // TODO: this won't work for multithreaded programs
-    kill(tid, SIGUSR2);
-  #else
-    syscall(SYS_tkill, tid, SIGUSR2);
-  #endif
+static bool reader_alive(msgq_queue_t *q, uint64_t id){
+  // Sockets outlive the thread that created them, so only the owning process counts.
+  // A slot that is being claimed has no pid yet.
+  if (*q->read_uids[id] == MSGQ_READER_CLAIMING) return true;
+  pid_t pid = *q->read_pids[id];
+  return pid == 0 || (kill(pid, 0) == 0) || (errno != ESRCH);
+}
+
+// Slots that are being claimed rank last, new readers start valid so invalid ones were lapped
+static uint64_t reader_lag(msgq_queue_t *q, uint64_t id){
+  if (*q->read_uids[id] == MSGQ_READER_CLAIMING) return 0;
+  if (!*q->read_valids[id]) return UINT64_MAX;
+
+  uint32_t read_cycles, read_pointer;
+  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  return (uint64_t)(write_cycles - read_cycles) * q->size + write_pointer - read_pointer;
+}
+
+// Take over slot id if it still belongs to expected_uid. The slot is marked as being claimed
+// until its pid and read pointer are set, so nobody sees the new uid next to stale state.
+static bool claim_reader(msgq_queue_t *q, uint64_t id, uint64_t expected_uid, uint64_t uid){
+  if (expected_uid == MSGQ_READER_CLAIMING ||
+      !std::atomic_compare_exchange_strong(q->read_uids[id], &expected_uid, (uint64_t)MSGQ_READER_CLAIMING)){
+    return false;
+  }
+
+  q->reader_id = id;
+  q->read_uid_local = uid;
+  *q->read_pids[id] = getpid();
+
+  // Start at the write pointer, like msgq_reset_reader
+  *q->read_pointers[id] = (uint64_t)*q->write_pointer;
+  *q->read_valids[id] = true;
+  *q->read_doorbells[id] = uid & 0xFFFFFFFF;
+
+  memset(&q->stats->readers[id], 0, sizeof(msgq_reader_stats_t));
+
+  *q->read_uids[id] = uid;
+  return true;
 }
 
 void msgq_init_subscriber(msgq_queue_t * q) {
@@ -175,40 +394,50 @@ void msgq_init_subscriber(msgq_queue_t * q) {
   // Get reader id
   while (true){
     uint64_t cur_num_readers = *q->num_readers;
-    uint64_t new_num_readers = cur_num_readers + 1;
 
-    // No more slots available. Reset all subscribers to kick out inactive ones
-    if (new_num_readers > NUM_READERS){
-      std::cout << "Warning, evicting all subscribers!" << std::endl;
-      *q->num_readers = 0;
-
-      for (size_t i = 0; i < NUM_READERS; i++){
-        *q->read_valids[i] = false;
-
-        uint64_t old_uid = *q->read_uids[i];
-        *q->read_uids[i] = 0;
-
-        // Wake up reader in case they are in a poll
-        thread_signal(old_uid & 0xFFFFFFFF);
+    // Reuse slots released by closed readers or owned by threads that no longer exist
+    bool claimed = false;
+    for (uint64_t i = 0; i < cur_num_readers && !claimed; i++){
+      uint64_t old_uid = *q->read_uids[i];
+      if (old_uid == 0 || !reader_alive(q, i)){
+        claimed = claim_reader(q, i, old_uid, uid);
+      }
+    }
+    if (claimed) break;
+
+    // No more slots available. Evict the reader that is furthest behind
+    if (cur_num_readers >= NUM_READERS){
+      uint64_t stalest = 0, max_lag = 0;
+      for (uint64_t i = 0; i < NUM_READERS; i++){
+        uint64_t lag = reader_lag(q, i);
+        if (lag >= max_lag){
+          max_lag = lag;
+          stalest = i;
+        }
       }
 
+      uint64_t old_uid = *q->read_uids[stalest];
+      // The evicted reader may poll on another thread than the one that subscribed
+      uint64_t old_doorbell = *q->read_doorbells[stalest];
+      std::cout << "Warning, evicting subscriber " << stalest << " on " << q->endpoint << std::endl;
+      if (claim_reader(q, stalest, old_uid, uid)){
+        __atomic_fetch_add(&q->stats->evictions, 1, __ATOMIC_RELAXED);
+        // Wake up evicted reader in case they are in a poll
+        doorbell_ring(old_doorbell);
+        break;
+      }
       continue;
     }
 
     // Use atomic compare and swap to handle race condition
     // where two subscribers start at the same time
+    uint64_t new_num_readers = cur_num_readers + 1;
     if (std::atomic_compare_exchange_strong(q->num_readers,
                                             &cur_num_readers,
                                             new_num_readers)){
-      q->reader_id = cur_num_readers;
-      q->read_uid_local = uid;
-
-      // We start with read_valid = false,
-      // on the first read the read pointer will be synchronized with the write pointer
-      *q->read_valids[cur_num_readers] = false;
-      *q->read_pointers[cur_num_readers] = 0;
-      *q->read_uids[cur_num_readers] = uid;
-      break;
+      // Slot is ours, set by the publisher or a previous subscriber
+      uint64_t old_uid = *q->read_uids[cur_num_readers];
+      if (claim_reader(q, cur_num_readers, old_uid, uid)) break;
     }
   }
 
@@ -216,7 +445,161 @@ void msgq_init_subscriber(msgq_queue_t * q) {
   msgq_reset_reader(q);
 }
 
-int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+// Multi publisher reserve. Space is claimed with a CAS on the reserve pointer, so concurrent
+// publishers get disjoint slots. The slot is tagged with a negative size until commit,
+// which lets readers skip it if it never gets committed.
+static int msgq_msg_reserve_multi(msgq_msg_t * msg, msgq_queue_t *q){
+  if (*q->multi_publisher != MSGQ_MULTI_PUBLISHER_READY){
+    std::cout << "Killing old publisher: " << q->endpoint << std::endl;
+    errno = EADDRINUSE;
+    return -1;
+  }
+
+  uint64_t total_msg_size = ALIGN(msg->size + sizeof(int64_t));
+  if (3 * total_msg_size > q->size){
+    std::cout << "Dropping message of " << msg->size << " bytes, too large for " << q->endpoint << std::endl;
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  // On success reserve holds the end of the previous reservation
+  uint64_t reserve = *q->write_reserve_pointer;
+  uint64_t end;
+  uint32_t write_cycles, write_pointer;
+  bool wrap;
+  do {
+    UNPACK64(write_cycles, write_pointer, reserve);
+
+    // Same rule as the single publisher, leave space for the next wraparound tag
+    int64_t remaining_space = q->size - write_pointer - total_msg_size - sizeof(int64_t);
+    wrap = remaining_space <= 0;
+    if (wrap){
+      PACK64(end, write_cycles + 1, total_msg_size);
+    } else {
+      PACK64(end, write_cycles, write_pointer + total_msg_size);
+    }
+  } while (!std::atomic_compare_exchange_weak(q->write_reserve_pointer, &reserve, end));
+
+  uint64_t num_readers = *q->num_readers;
+
+  if (wrap){
+    // Readers only get to the tag once everything before it is committed
+    *(int64_t*)(q->data + write_pointer) = -1;
+
+    for (uint64_t i = 0; i < num_readers; i++){
+      uint32_t read_cycles, read_pointer;
+      UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
+
+      if ((read_pointer > write_pointer) && (read_cycles != write_cycles) && *q->read_valids[i]) {
+        *q->read_valids[i] = false;
+      }
+    }
+    stat_add(&q->stats->writer.wraparounds);
+
+    write_cycles++;
+    write_pointer = 0;
+  }
+
+  for (uint64_t i = 0; i < num_readers; i++){
+    uint32_t read_cycles, read_pointer;
+    UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
+
+    if ((read_pointer >= write_pointer) && (read_pointer < write_pointer + total_msg_size) && (read_cycles != write_cycles) && *q->read_valids[i]) {
+      *q->read_valids[i] = false;
+    }
+  }
+
+  char *p = q->data + write_pointer;
+  reinterpret_cast<std::atomic<int64_t>*>(p)->store(-(int64_t)total_msg_size);
+
+  msg->data = p + sizeof(int64_t);
+  q->write_reserved_size = msg->size;
+  q->write_reserved_start = reserve;
+  q->write_reserved_end = end;
+
+  return msg->size;
+}
+
+// Multi publisher commit. Messages become visible in reservation order, so this waits
+// for the publishers that reserved before us. One that holds its reservation for longer
+// than MSGQ_COMMIT_TIMEOUT_MS is skipped, readers step over its slot.
+static int msgq_msg_commit_multi(msgq_msg_t * msg, msgq_queue_t *q){
+  // The slot sits at the end of the reservation, which can start with a wraparound tag
+  uint32_t write_cycles, end_pointer;
+  UNPACK64(write_cycles, end_pointer, q->write_reserved_end);
+  uint32_t write_pointer = end_pointer - ALIGN(q->write_reserved_size + sizeof(int64_t));
+
+  char *p = q->data + write_pointer;
+  assert(msg->data == p + sizeof(int64_t));
+  assert(msg->size <= q->write_reserved_size);
+  q->write_reserved_size = 0;
+
+  // The write pointer has to reach the end of the previous reservation first
+  uint64_t start = q->write_reserved_start;
+  uint32_t start_cycles, start_pointer;
+  UNPACK64(start_cycles, start_pointer, start);
+  uint64_t linear_start = (uint64_t)start_cycles * q->size + start_pointer;
+  uint64_t deadline = msgq_now() + MSGQ_COMMIT_TIMEOUT_MS * 1000000ULL;
+
+  uint64_t expected = *q->write_pointer;
+  while (expected != start){
+    uint32_t cycles, pointer;
+    UNPACK64(cycles, pointer, expected);
+    if ((uint64_t)cycles * q->size + pointer > linear_start){
+      // We stalled and got skipped, the slot may already be reused
+      std::cout << "Warning, dropping stalled message on " << q->endpoint << std::endl;
+      errno = ETIMEDOUT;
+      return -1;
+    }
+
+    if (msgq_now() > deadline){
+      if (std::atomic_compare_exchange_strong(q->write_pointer, &expected, start)){
+        std::cout << "Warning, skipping stalled publisher on " << q->endpoint << std::endl;
+        break;
+      }
+    } else {
+      std::this_thread::yield();
+      expected = *q->write_pointer;
+    }
+  }
+
+  // A shorter message than reserved leaves a gap, tag it so readers skip to the next slot
+  uint32_t msg_end = ALIGN(write_pointer + msg->size + sizeof(int64_t));
+  if (msg_end < end_pointer){
+    *(int64_t*)(q->data + msg_end) = -(int64_t)(end_pointer - msg_end);
+  }
+
+  std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
+  *size_p = msg->size;
+  __sync_synchronize();
+
+  q->stats->writer.last_send_time = msgq_now();
+
+  // The next publisher only commits after the write pointer moves, so the history and stats are still ours
+  uint64_t history_count = *q->history_count;
+  PACK64(*q->history[history_count % MSGQ_HISTORY_SIZE], write_cycles, write_pointer);
+  *q->history_count = history_count + 1;
+  stat_add(&q->stats->writer.msgs_sent);
+  stat_add(&q->stats->writer.bytes_sent, msg->size);
+
+  // Fails if a publisher after us timed out and skipped ahead in the meantime, our message is in place anyway
+  std::atomic_compare_exchange_strong(q->write_pointer, &start, q->write_reserved_end);
+
+  uint64_t num_readers = *q->num_readers;
+  for (uint64_t i = 0; i < num_readers; i++){
+    if (*q->read_uids[i] != 0) doorbell_ring(*q->read_doorbells[i]);
+  }
+
+  return msg->size;
+}
+
+// Reserve space for a message of msg->size bytes in the ring, msg->data is pointed at the slot.
+// Readers in the reserved area are invalidated, the message becomes visible on commit.
+int msgq_msg_reserve(msgq_msg_t * msg, msgq_queue_t *q){
+  if (q->multi_publisher_local){
+    return msgq_msg_reserve_multi(msg, q);
+  }
+
   // Die if we are no longer the active publisher
   if (q->write_uid_local != *q->write_uid){
     std::cout << "Killing old publisher: " << q->endpoint << std::endl;
@@ -228,7 +611,11 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
 
   // We need to fit at least three messages in the queue,
   // then we can always safely access the last message
-  assert(3 * total_msg_size <= q->size);
+  if (3 * total_msg_size > q->size){
+    std::cout << "Dropping message of " << msg->size << " bytes, too large for " << q->endpoint << std::endl;
+    errno = EMSGSIZE;
+    return -1;
+  }
 
   uint64_t num_readers = *q->num_readers;
 
@@ -251,7 +638,7 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
       uint64_t read_cycles = read_pointer >> 32;
       read_pointer &= 0xFFFFFFFF;
 
-      if ((read_pointer > write_pointer) && (read_cycles != write_cycles)) {
+      if ((read_pointer > write_pointer) && (read_cycles != write_cycles) && *q->read_valids[i]) {
         *q->read_valids[i] = false;
       }
     }
@@ -260,6 +647,7 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
     write_pointer = 0;
     write_cycles = write_cycles + 1;
     PACK64(*q->write_pointer, write_cycles, write_pointer);
+    stat_add(&q->stats->writer.wraparounds);
 
     // Set actual pointer to the beginning of the data segment
     p = q->data;
@@ -273,33 +661,73 @@ int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
     uint32_t read_cycles, read_pointer;
     UNPACK64(read_cycles, read_pointer, *q->read_pointers[i]);
 
-    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles)) {
+    if ((read_pointer >= start) && (read_pointer < end) && (read_cycles != write_cycles) && *q->read_valids[i]) {
       *q->read_valids[i] = false;
     }
   }
 
 
+  msg->data = p + sizeof(int64_t);
+  q->write_reserved_size = msg->size;
+
+  return msg->size;
+}
+
+// Publish a message previously reserved with msgq_msg_reserve. msg->size may be smaller than the reservation.
+int msgq_msg_commit(msgq_msg_t * msg, msgq_queue_t *q){
+  if (q->multi_publisher_local){
+    return msgq_msg_commit_multi(msg, q);
+  }
+
+  uint32_t write_cycles, write_pointer;
+  UNPACK64(write_cycles, write_pointer, *q->write_pointer);
+
+  char *p = q->data + write_pointer;
+  assert(msg->data == p + sizeof(int64_t));
+  assert(msg->size <= q->write_reserved_size);
+  q->write_reserved_size = 0;
+
   // Write size tag
   std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
   *size_p = msg->size;
-
-  // Copy data
-  memcpy(p + sizeof(int64_t), msg->data, msg->size);
   __sync_synchronize();
 
+  // Stored before the write pointer, so a reader that sees this message sees its send time
+  q->stats->writer.last_send_time = msgq_now();
+
+  // Record the message start for late subscribers before it becomes visible
+  uint64_t history_count = *q->history_count;
+  PACK64(*q->history[history_count % MSGQ_HISTORY_SIZE], write_cycles, write_pointer);
+
   // Update write pointer
   uint32_t new_ptr = ALIGN(write_pointer + msg->size + sizeof(int64_t));
   PACK64(*q->write_pointer, write_cycles, new_ptr);
+  *q->history_count = history_count + 1;
+
+  stat_add(&q->stats->writer.msgs_sent);
+  stat_add(&q->stats->writer.bytes_sent, msg->size);
 
   // Notify readers
+  uint64_t num_readers = *q->num_readers;
   for (uint64_t i = 0; i < num_readers; i++){
-    uint64_t reader_uid = *q->read_uids[i];
-    thread_signal(reader_uid & 0xFFFFFFFF);
+    if (*q->read_uids[i] != 0) doorbell_ring(*q->read_doorbells[i]);
   }
 
   return msg->size;
 }
 
+int msgq_msg_send(msgq_msg_t * msg, msgq_queue_t *q){
+  msgq_msg_t slot;
+  slot.size = msg->size;
+  if (msgq_msg_reserve(&slot, q) < 0){
+    return -1;
+  }
+
+  // Copy data
+  memcpy(slot.data, msg->data, msg->size);
+  return msgq_msg_commit(&slot, q);
+}
+
 
 int msgq_msg_ready(msgq_queue_t * q){
  start:
@@ -314,12 +742,15 @@ int msgq_msg_ready(msgq_queue_t * q){
 
   // Check valid
   if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+    reader_lapped(q);
     goto start;
   }
 
+  // The read pointer is still on a leased message, compare against the message after it
+  uint64_t read_pointer_packed = q->lease_active ? q->lease_read_pointer : (uint64_t)*q->read_pointers[id];
+
   uint32_t read_cycles, read_pointer;
-  UNPACK64(read_cycles, read_pointer, *q->read_pointers[id]);
+  UNPACK64(read_cycles, read_pointer, read_pointer_packed);
 
   uint32_t write_cycles, write_pointer;
   UNPACK64(write_cycles, write_pointer, *q->write_pointer);
@@ -328,7 +759,26 @@ int msgq_msg_ready(msgq_queue_t * q){
   return (read_pointer != write_pointer);
 }
 
-int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+void msgq_msg_release(msgq_queue_t * q){
+  if (!q->lease_active) return;
+  q->lease_active = false;
+
+  // Only advance if we still own the slot, an invalid reader is reset on the next receive
+  int id = q->reader_id;
+  if (q->read_uid_local == *q->read_uids[id] && *q->read_valids[id]){
+    *q->read_pointers[id] = q->lease_read_pointer;
+  }
+}
+
+bool msgq_msg_lease_valid(msgq_queue_t * q){
+  int id = q->reader_id;
+  __sync_synchronize();
+  return q->lease_active && q->read_uid_local == *q->read_uids[id] && *q->read_valids[id];
+}
+
+static int msgq_msg_recv_internal(msgq_msg_t * msg, msgq_queue_t * q, bool lease){
+  msgq_msg_release(q);
+
  start:
   int id = q->reader_id;
   assert(id >= 0); // Make sure subscriber is initialized
@@ -341,7 +791,7 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
 
   // Check valid
   if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+    reader_lapped(q);
     goto start;
   }
 
@@ -359,13 +809,30 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     return 0;
   }
 
+  // Conflating readers jump straight to the newest message instead of walking the backlog.
+  // It is always ahead of our valid read pointer, so it can't have been overwritten yet.
+  if (q->read_conflate){
+    uint64_t count = *q->history_count;
+    if (count > 0){
+      uint32_t latest_cycles, latest_pointer;
+      UNPACK64(latest_cycles, latest_pointer, *q->history[(count - 1) % MSGQ_HISTORY_SIZE]);
+
+      uint64_t distance = (uint64_t)(latest_cycles - read_cycles) * q->size + latest_pointer - read_pointer;
+      if (distance > 0 && distance < q->size){
+        PACK64(*q->read_pointers[id], latest_cycles, latest_pointer);
+        stat_add(&q->stats->readers[id].conflate_skips);
+        goto start;
+      }
+    }
+  }
+
   // Read potential message size
   std::atomic<int64_t> *size_p = reinterpret_cast<std::atomic<int64_t>*>(p);
   std::int64_t size = *size_p;
 
   // Check if the size that was read is valid
   if (!*q->read_valids[id]){
-    msgq_reset_reader(q);
+    reader_lapped(q);
     goto start;
   }
 
@@ -376,6 +843,12 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     goto start;
   }
 
+  // Any other negative size is a slot a multi publisher reserved without filling it
+  if (size < -1){
+    PACK64(*q->read_pointers[id], read_cycles, read_pointer - size);
+    goto start;
+  }
+
   // crashing is better than passing garbage data to the consumer
   // the size will have weird value if it was overwritten by data accidentally
   assert((uint64_t)size < q->size);
@@ -388,10 +861,37 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
     if (new_read_pointer != write_pointer){
       // Update read pointer
       PACK64(*q->read_pointers[id], read_cycles, new_read_pointer);
+      stat_add(&q->stats->readers[id].conflate_skips);
       goto start;
     }
   }
 
+  // Lag is measured before this message is consumed. Send latency is only exact for the newest message
+  msgq_reader_stats_t *stats = &q->stats->readers[id];
+  stat_add(&stats->msgs);
+  stat_add(&stats->lag_hist[log2_bucket((uint64_t)(write_cycles - read_cycles) * q->size + write_pointer - read_pointer, MSGQ_LAG_BUCKETS)]);
+  if (new_read_pointer == write_pointer){
+    uint64_t latency_us = (msgq_now() - q->stats->writer.last_send_time) / 1000;
+    stat_add(&stats->latency_hist[log2_bucket(latency_us, MSGQ_LATENCY_BUCKETS)]);
+  }
+
+  // Hand out a pointer into the ring. The read pointer is advanced on release,
+  // until then the writer will invalidate us if it overwrites the message
+  if (lease){
+    msg->size = size;
+    msg->data = p + sizeof(int64_t);
+
+    q->lease_active = true;
+    PACK64(q->lease_read_pointer, read_cycles, new_read_pointer);
+
+    if (!msgq_msg_lease_valid(q)){
+      reader_lapped(q);
+      goto start;
+    }
+
+    return msg->size;
+  }
+
   // Copy message
   if (msgq_msg_init_size(msg, size) < 0)
     return -1;
@@ -406,7 +906,7 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   // Check if the actual data that was copied is valid
   if (!*q->read_valids[id]){
     msgq_msg_close(msg);
-    msgq_reset_reader(q);
+    reader_lapped(q);
     goto start;
   }
 
@@ -414,51 +914,92 @@ int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
   return msg->size;
 }
 
+int msgq_msg_recv(msgq_msg_t * msg, msgq_queue_t * q){
+  return msgq_msg_recv_internal(msg, q, false);
+}
+
+// Zero-copy receive, msg->data points into the ring and must not be closed.
+// The data stays in place until the next receive on this queue or msgq_msg_release,
+// check msgq_msg_lease_valid after reading it to detect the writer overwriting it.
+int msgq_msg_recv_lease(msgq_msg_t * msg, msgq_queue_t * q){
+  return msgq_msg_recv_internal(msg, q, true);
+}
 
 
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout){
   int num = 0;
 
-  // Check if messages ready
+  // Point all readers at this thread's doorbell, the poll might run on
+  // a different thread than the one that created the subscriber
+  uint64_t doorbell = msgq_gettid();
   for (size_t i = 0; i < nitems; i++) {
-    items[i].revents = msgq_msg_ready(items[i].q);
-    if (items[i].revents) num++;
+    msgq_queue_t *q = items[i].q;
+    if (q->reader_id >= 0 && *q->read_doorbells[q->reader_id] != doorbell){
+      *q->read_doorbells[q->reader_id] = doorbell;
+    }
   }
 
-  int ms = (timeout == -1) ? 100 : timeout;
-  struct timespec ts;
-  ts.tv_sec = ms / 1000;
-  ts.tv_nsec = (ms % 1000) * 1000 * 1000;
-
-
-  while (num == 0) {
-    int ret;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  doorbell_waiters(doorbell)->fetch_add(1);
 
-    ret = nanosleep(&ts, &ts);
+  while (true) {
+    // Read the sequence before checking the queues, so a message that arrives
+    // in between makes the futex wait return immediately
+    uint32_t seq = *doorbell_seq(doorbell);
 
     // Check if messages ready
     for (size_t i = 0; i < nitems; i++) {
-      if (items[i].revents == 0 && msgq_msg_ready(items[i].q)){
-        num += 1;
-        items[i].revents = 1;
-      }
+      items[i].revents = msgq_msg_ready(items[i].q);
+      if (items[i].revents) num++;
     }
 
-    // exit if we had a timeout and the sleep finished
-    if (timeout != -1 && ret == 0){
-      break;
+    if (num > 0 || timeout == 0) break;
+
+    if (timeout == -1){
+      doorbell_wait(doorbell, seq, NULL);
+    } else {
+      auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if (remaining <= 0) break;
+
+      struct timespec ts;
+      ts.tv_sec = remaining / 1000000000LL;
+      ts.tv_nsec = remaining % 1000000000LL;
+      doorbell_wait(doorbell, seq, &ts);
     }
   }
 
+  doorbell_waiters(doorbell)->fetch_sub(1);
   return num;
 }
 
 bool msgq_all_readers_updated(msgq_queue_t *q) {
   uint64_t num_readers = *q->num_readers;
+  uint64_t active_readers = 0;
   for (uint64_t i = 0; i < num_readers; i++) {
+    if (*q->read_uids[i] == 0) continue;
+    active_readers++;
+
     if (*q->read_valids[i] && *q->write_pointer != *q->read_pointers[i]) {
       return false;
     }
   }
-  return num_readers > 0;
+  return active_readers > 0;
+}
+
+bool msgq_wait_readers_updated(msgq_queue_t *q, int timeout) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+  while (true) {
+    bool updated = true;
+    uint64_t num_readers = *q->num_readers;
+    for (uint64_t i = 0; i < num_readers && updated; i++) {
+      // Invalid readers skip ahead to the write pointer on their next read
+      if (*q->read_uids[i] == 0 || !*q->read_valids[i]) continue;
+      updated = *q->write_pointer == *q->read_pointers[i];
+    }
+    if (updated) return true;
+
+    if (timeout != -1 && std::chrono::steady_clock::now() > deadline) return false;
+    std::this_thread::sleep_for(std::chrono::microseconds(10));
+  }
 }
@@ -5,34 +5,111 @@
 #include <atomic>
 
 #define DEFAULT_SEGMENT_SIZE (10 * 1024 * 1024)
-#define NUM_READERS 10
+#define NUM_READERS 64
+#define NUM_DOORBELLS 1024
+#define MSGQ_STATS_MAGIC 0x6d73677173746174ULL
+#define MSGQ_LAG_BUCKETS 28
+#define MSGQ_LATENCY_BUCKETS 20
+#define MSGQ_HISTORY_SIZE 16
+#define MSGQ_HUGEPAGE_MIN_SIZE (2 * 1024 * 1024)
+#define MSGQ_COMMIT_TIMEOUT_MS 1000
+#define MSGQ_PREFIX_ENV "OPENPILOT_PREFIX"
+#define MSGQ_MULTI_PUBLISHER_OFF 0
+#define MSGQ_MULTI_PUBLISHER_INIT 1
+#define MSGQ_MULTI_PUBLISHER_READY 2
+#define MSGQ_READER_CLAIMING UINT64_MAX  // read_uid of a slot while its new owner sets it up
 #define ALIGN(n) ((n + (8 - 1)) & -8)
 
 #define UNPACK64(higher, lower, input) do {uint64_t tmp = input; higher = tmp >> 32; lower = tmp & 0xFFFFFFFF;} while (0)
 #define PACK64(output, higher, lower) output = ((uint64_t)higher << 32 ) | ((uint64_t)lower & 0xFFFFFFFF)
 
+// Counters kept next to the ring, dumped by msgq_stats. Histograms use log2 buckets,
+// lag is in bytes behind the writer and latency in microseconds since the message was sent.
+// The writer and every reader slot have their own cache lines, and only write their own counters.
+struct alignas(64) msgq_writer_stats_t {
+  uint64_t msgs_sent;
+  uint64_t bytes_sent;
+  uint64_t wraparounds;
+  uint64_t last_send_time;
+};
+
+struct alignas(64) msgq_reader_stats_t {
+  uint64_t msgs;
+  uint64_t invalidations;  // counted when the reader notices the writer lapped it
+  uint64_t conflate_skips;
+  uint64_t lag_hist[MSGQ_LAG_BUCKETS];
+  uint64_t latency_hist[MSGQ_LATENCY_BUCKETS];
+};
+
+struct msgq_stats_t {
+  uint64_t magic;
+  uint64_t evictions;  // by subscribers
+  msgq_writer_stats_t writer;
+  msgq_reader_stats_t readers[NUM_READERS];
+};
+
 struct  msgq_header_t {
   uint64_t num_readers;
   uint64_t write_pointer;
   uint64_t write_uid;
+
+  // Multi publisher mode. Publishers claim space by moving write_reserve_pointer,
+  // and commit in reservation order by moving write_pointer.
+  uint64_t multi_publisher;  // MSGQ_MULTI_PUBLISHER_*
+  uint64_t write_reserve_pointer;
+
   uint64_t read_pointers[NUM_READERS];
   uint64_t read_valids[NUM_READERS];
   uint64_t read_uids[NUM_READERS];
+  uint64_t read_pids[NUM_READERS];  // process owning the slot, the socket can be used from any of its threads
+  uint64_t read_doorbells[NUM_READERS];
+
+  // Start of the last MSGQ_HISTORY_SIZE messages, packed like the write pointer.
+  // history_count is the total number of messages recorded.
+  uint64_t history[MSGQ_HISTORY_SIZE];
+  uint64_t history_count;
+
+  msgq_stats_t stats;
+};
+
+// Futex words shared by all queues, a polling thread sleeps on its own doorbell
+// and publishers ring the doorbells of their readers after every message
+struct msgq_doorbell_t {
+  uint32_t seq;
+  uint32_t waiters;
 };
 
 struct msgq_queue_t {
   std::atomic<uint64_t> *num_readers;
   std::atomic<uint64_t> *write_pointer;
   std::atomic<uint64_t> *write_uid;
+  std::atomic<uint64_t> *multi_publisher;
+  std::atomic<uint64_t> *write_reserve_pointer;
   std::atomic<uint64_t> *read_pointers[NUM_READERS];
   std::atomic<uint64_t> *read_valids[NUM_READERS];
   std::atomic<uint64_t> *read_uids[NUM_READERS];
+  std::atomic<uint64_t> *read_pids[NUM_READERS];
+  std::atomic<uint64_t> *read_doorbells[NUM_READERS];
+  std::atomic<uint64_t> *history[MSGQ_HISTORY_SIZE];
+  std::atomic<uint64_t> *history_count;
+  msgq_stats_t *stats;
   char * mmap_p;
   char * data;
   size_t size;
   int reader_id;
   uint64_t read_uid_local;
   uint64_t write_uid_local;
+  uint64_t write_reserved_size;
+
+  // Reservation of a multi publisher, packed like the write pointer
+  bool multi_publisher_local;
+  uint64_t write_reserved_start;
+  uint64_t write_reserved_end;
+
+  // Outstanding zero-copy lease. The read pointer stays on the leased message
+  // so the writer invalidates this reader if it overwrites it.
+  bool lease_active;
+  uint64_t lease_read_pointer;
 
   bool read_conflate;
   std::string endpoint;
@@ -48,8 +125,14 @@ struct msgq_pollitem_t {
   int revents;
 };
 
+// Queues live in /dev/shm/<prefix>/ if OPENPILOT_PREFIX is set, so several stacks can run on one host.
+// The prefix is read when a queue is opened, msgq_set_prefix also applies to child processes.
+std::string msgq_shm_dir(void);
+void msgq_set_prefix(const char *prefix);
+
 void msgq_wait_for_subscriber(msgq_queue_t *q);
 void msgq_reset_reader(msgq_queue_t *q);
+size_t msgq_rewind_reader(msgq_queue_t *q, size_t n);
 
 int msgq_msg_init_size(msgq_msg_t *msg, size_t size);
 int msgq_msg_init_data(msgq_msg_t *msg, char * data, size_t size);
@@ -58,11 +141,18 @@ int msgq_msg_close(msgq_msg_t *msg);
 int msgq_new_queue(msgq_queue_t * q, const char * path, size_t size);
 void msgq_close_queue(msgq_queue_t *q);
 void msgq_init_publisher(msgq_queue_t * q);
+void msgq_init_multi_publisher(msgq_queue_t * q);
 void msgq_init_subscriber(msgq_queue_t * q);
 
 int msgq_msg_send(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_reserve(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_commit(msgq_msg_t *msg, msgq_queue_t *q);
 int msgq_msg_recv(msgq_msg_t *msg, msgq_queue_t *q);
+int msgq_msg_recv_lease(msgq_msg_t *msg, msgq_queue_t *q);
+bool msgq_msg_lease_valid(msgq_queue_t *q);
+void msgq_msg_release(msgq_queue_t *q);
 int msgq_msg_ready(msgq_queue_t * q);
 int msgq_poll(msgq_pollitem_t * items, size_t nitems, int timeout);
 
 bool msgq_all_readers_updated(msgq_queue_t *q);
+bool msgq_wait_readers_updated(msgq_queue_t *q, int timeout);
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "msgq.h"
+
+// Dumps the telemetry kept in the msgq headers of every queue in /dev/shm,
+// or /dev/shm/<prefix> when OPENPILOT_PREFIX is set
+// usage: msgq_stats [service filter] [--once]
+
+volatile sig_atomic_t do_exit = 0;
+
+static void sig_handler(int signal) {
+  do_exit = 1;
+}
+
+struct QueueView {
+  std::string name;
+  size_t size;
+  msgq_header_t *header;
+};
+
+static bool open_queue(const std::string &name, QueueView *view) {
+  std::string path = msgq_shm_dir() + "/" + name;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size <= sizeof(msgq_header_t)) {
+    close(fd);
+    return false;
+  }
+
+  void *mem = mmap(NULL, sizeof(msgq_header_t), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) return false;
+
+  msgq_header_t *header = (msgq_header_t *)mem;
+  if (header->stats.magic != MSGQ_STATS_MAGIC) {
+    munmap(mem, sizeof(msgq_header_t));
+    return false;
+  }
+
+  view->name = name;
+  view->size = st.st_size - sizeof(msgq_header_t);
+  view->header = header;
+  return true;
+}
+
+static std::vector<QueueView> find_queues(const std::string &filter) {
+  std::vector<QueueView> queues;
+  DIR *dir = opendir(msgq_shm_dir().c_str());
+  if (dir == NULL) return queues;
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    std::string name = entry->d_name;
+    if (name[0] == '.' || entry->d_type == DT_DIR || name.find(filter) == std::string::npos) continue;
+
+    QueueView view;
+    if (open_queue(name, &view)) queues.push_back(view);
+  }
+  closedir(dir);
+
+  std::sort(queues.begin(), queues.end(), [](const QueueView &a, const QueueView &b) { return a.name < b.name; });
+  return queues;
+}
+
+// Upper bound of the log2 bucket that contains the given percentile
+static uint64_t percentile(const uint64_t *hist, int num_buckets, double pct) {
+  uint64_t total = 0;
+  for (int i = 0; i < num_buckets; i++) total += hist[i];
+  if (total == 0) return 0;
+
+  uint64_t count = 0;
+  for (int i = 0; i < num_buckets; i++) {
+    count += hist[i];
+    if (count >= total * pct) return (i == 0) ? 0 : (1ULL << i) - 1;
+  }
+  return (1ULL << (num_buckets - 1));
+}
+
+static uint64_t reader_lag(const QueueView &q, int id) {
+  const msgq_header_t *h = q.header;
+  uint64_t read_pointer = h->read_pointers[id], write_pointer = h->write_pointer;
+  uint64_t cycles = (write_pointer >> 32) - (read_pointer >> 32);
+  return cycles * q.size + (write_pointer & 0xFFFFFFFF) - (read_pointer & 0xFFFFFFFF);
+}
+
+int main(int argc, char** argv) {
+  std::signal(SIGINT, sig_handler);
+  std::signal(SIGTERM, sig_handler);
+
+  std::string filter = "";
+  bool once = false;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--once") == 0) {
+      once = true;
+    } else {
+      filter = argv[i];
+    }
+  }
+
+  std::map<std::string, std::pair<uint64_t, uint64_t>> prev_sent;
+  auto prev_time = std::chrono::steady_clock::now();
+
+  while (!do_exit) {
+    auto queues = find_queues(filter);
+    auto now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now - prev_time).count();
+    prev_time = now;
+
+    if (!once) printf("\033[2J\033[H");
+    printf("%-28s %7s %9s %8s %7s %6s\n", "queue", "readers", "msgs/s", "kB/s", "wraps", "evict");
+    for (auto &q : queues) {
+      const msgq_stats_t &stats = q.header->stats;
+      uint64_t num_readers = std::min(q.header->num_readers, (uint64_t)NUM_READERS);
+
+      auto &prev = prev_sent[q.name];
+      double msgs_rate = (prev.first && dt > 0) ? (stats.writer.msgs_sent - prev.first) / dt : 0;
+      double bytes_rate = (prev.second && dt > 0) ? (stats.writer.bytes_sent - prev.second) / dt : 0;
+      prev = {stats.writer.msgs_sent, stats.writer.bytes_sent};
+
+      int active = 0;
+      for (uint64_t i = 0; i < num_readers; i++) active += q.header->read_uids[i] != 0 && q.header->read_uids[i] != MSGQ_READER_CLAIMING;
+
+      printf("%-28s %7d %9.1f %8.1f %7lu %6lu\n", q.name.c_str(), active, msgs_rate, bytes_rate / 1024.,
+             (unsigned long)stats.writer.wraparounds, (unsigned long)stats.evictions);
+
+      for (uint64_t i = 0; i < num_readers; i++) {
+        uint64_t uid = q.header->read_uids[i];
+        if (uid == 0 || uid == MSGQ_READER_CLAIMING) continue;
+
+        const msgq_reader_stats_t &r = stats.readers[i];
+        printf("  reader %2lu tid %-7u %s lag %9lu B  msgs %9lu  inval %5lu  skips %7lu  lag p50/p99 %8lu/%-8lu B  latency p50/p99 %6lu/%-6lu us\n",
+               (unsigned long)i, (uint32_t)(uid & 0xFFFFFFFF), q.header->read_valids[i] ? "valid  " : "invalid",
+               (unsigned long)reader_lag(q, i), (unsigned long)r.msgs,
+               (unsigned long)r.invalidations, (unsigned long)r.conflate_skips,
+               (unsigned long)percentile(r.lag_hist, MSGQ_LAG_BUCKETS, 0.5),
+               (unsigned long)percentile(r.lag_hist, MSGQ_LAG_BUCKETS, 0.99),
+               (unsigned long)percentile(r.latency_hist, MSGQ_LATENCY_BUCKETS, 0.5),
+               (unsigned long)percentile(r.latency_hist, MSGQ_LATENCY_BUCKETS, 0.99));
+      }
+    }
+
+    for (auto &q : queues) munmap(q.header, sizeof(msgq_header_t));
+    if (once) break;
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+
+  return 0;
+}
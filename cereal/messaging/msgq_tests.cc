@@ -0,0 +1,304 @@
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "catch2/catch.hpp"
+#include "msgq.h"
+
+TEST_CASE("msgq_init_multi_publisher racing processes"){
+  const uint64_t num_msgs = 100;
+
+  for (int iter = 0; iter < 20; iter++){
+    remove((msgq_shm_dir() + "/test_multi_init").c_str());
+
+    // 0: waiting, 1: go, 2: child initialized
+    std::atomic<int> *sync = (std::atomic<int> *)mmap(NULL, sizeof(std::atomic<int>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    REQUIRE(sync != MAP_FAILED);
+    *sync = 0;
+
+    msgq_queue_t sub;
+    msgq_new_queue(&sub, "test_multi_init", 1024 * 1024);
+
+    pid_t pid = fork();
+    if (pid == 0){
+      msgq_queue_t q;
+      msgq_new_queue(&q, "test_multi_init", 1024 * 1024);
+      while (*sync == 0) {}
+      msgq_init_multi_publisher(&q);
+      *sync = 2;
+      // Wait for the parent to subscribe
+      while (*sync != 3) usleep(100);
+
+      for (uint64_t i = 0; i < num_msgs; i++){
+        msgq_msg_t msg;
+        msgq_msg_init_data(&msg, (char*)&i, sizeof(i));
+        msgq_msg_send(&msg, &q);
+        msgq_msg_close(&msg);
+      }
+      _exit(0);
+    }
+
+    msgq_queue_t q;
+    msgq_new_queue(&q, "test_multi_init", 1024 * 1024);
+    *sync = 1;
+    msgq_init_multi_publisher(&q);
+    while (*sync != 2) usleep(100);
+
+    REQUIRE(*q.multi_publisher == MSGQ_MULTI_PUBLISHER_READY);
+    REQUIRE(*q.write_reserve_pointer == *q.write_pointer);
+
+    msgq_init_subscriber(&sub);
+    *sync = 3;
+
+    for (uint64_t i = 0; i < num_msgs; i++){
+      msgq_msg_t msg;
+      msgq_msg_init_data(&msg, (char*)&i, sizeof(i));
+      REQUIRE(msgq_msg_send(&msg, &q) == sizeof(i));
+      msgq_msg_close(&msg);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    REQUIRE(WEXITSTATUS(status) == 0);
+
+    uint64_t received = 0;
+    msgq_msg_t msg;
+    while (msgq_msg_recv(&msg, &sub) > 0){
+      REQUIRE(msg.size == sizeof(uint64_t));
+      msgq_msg_close(&msg);
+      received++;
+    }
+    REQUIRE(received == 2 * num_msgs);
+
+    msgq_close_queue(&q);
+    msgq_close_queue(&sub);
+    munmap(sync, sizeof(std::atomic<int>));
+  }
+  remove((msgq_shm_dir() + "/test_multi_init").c_str());
+}
+
+TEST_CASE("msgq_init_subscriber keeps slots of readers whose thread exited"){
+  remove((msgq_shm_dir() + "/test_reader_alive").c_str());
+  msgq_queue_t pub, sub1, sub2;
+  msgq_new_queue(&pub, "test_reader_alive", 1024 * 1024);
+  msgq_new_queue(&sub1, "test_reader_alive", 1024 * 1024);
+  msgq_new_queue(&sub2, "test_reader_alive", 1024 * 1024);
+  msgq_init_publisher(&pub);
+
+  // Subscribed on a thread that is gone, but the socket is still used by this process
+  std::thread([&]() { msgq_init_subscriber(&sub1); }).join();
+  msgq_init_subscriber(&sub2);
+  REQUIRE(sub1.reader_id != sub2.reader_id);
+  REQUIRE(*sub1.read_pids[sub1.reader_id] == (uint64_t)getpid());
+
+  // Slots of dead processes are reused
+  pid_t pid = fork();
+  if (pid == 0){
+    msgq_queue_t q;
+    msgq_new_queue(&q, "test_reader_alive", 1024 * 1024);
+    msgq_init_subscriber(&q);
+    _exit(q.reader_id);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  int dead_id = WEXITSTATUS(status);
+  REQUIRE(dead_id != sub1.reader_id);
+  REQUIRE(dead_id != sub2.reader_id);
+
+  msgq_queue_t sub3;
+  msgq_new_queue(&sub3, "test_reader_alive", 1024 * 1024);
+  msgq_init_subscriber(&sub3);
+  REQUIRE(sub3.reader_id == dead_id);
+
+  for (auto q : {&pub, &sub1, &sub2, &sub3}) msgq_close_queue(q);
+  remove((msgq_shm_dir() + "/test_reader_alive").c_str());
+}
+
+TEST_CASE("msgq_msg_send drops messages too large for the ring"){
+  remove((msgq_shm_dir() + "/test_msg_size").c_str());
+  msgq_queue_t pub, sub;
+  msgq_new_queue(&pub, "test_msg_size", 1024 * 1024);
+  msgq_new_queue(&sub, "test_msg_size", 1024 * 1024);
+
+  std::vector<char> data(1024 * 1024 / 3);
+  msgq_msg_t msg;
+  msgq_msg_init_data(&msg, data.data(), data.size());
+
+  SECTION("single publisher"){
+    msgq_init_publisher(&pub);
+  }
+  SECTION("multi publisher"){
+    msgq_init_multi_publisher(&pub);
+  }
+  msgq_init_subscriber(&sub);
+
+  errno = 0;
+  REQUIRE(msgq_msg_send(&msg, &pub) == -1);
+  REQUIRE(errno == EMSGSIZE);
+  REQUIRE(msgq_msg_ready(&sub) == 0);
+
+  // The queue is still usable after the dropped message
+  msgq_msg_t small;
+  msgq_msg_init_data(&small, data.data(), 1024);
+  REQUIRE(msgq_msg_send(&small, &pub) == 1024);
+  msgq_msg_t recv;
+  REQUIRE(msgq_msg_recv(&recv, &sub) == 1024);
+  msgq_msg_close(&recv);
+
+  msgq_msg_close(&small);
+  msgq_msg_close(&msg);
+  msgq_close_queue(&pub);
+  msgq_close_queue(&sub);
+  remove((msgq_shm_dir() + "/test_msg_size").c_str());
+}
+
+TEST_CASE("msgq_init_subscriber leaves slots that are being claimed alone"){
+  remove((msgq_shm_dir() + "/test_reader_claim").c_str());
+  msgq_queue_t pub, sub1, sub2;
+  msgq_new_queue(&pub, "test_reader_claim", 1024 * 1024);
+  msgq_new_queue(&sub1, "test_reader_claim", 1024 * 1024);
+  msgq_new_queue(&sub2, "test_reader_claim", 1024 * 1024);
+  msgq_init_publisher(&pub);
+  msgq_init_subscriber(&sub1);
+
+  // Mid claim with the previous owner's pid still in place, which no longer exists
+  int id = sub1.reader_id;
+  *pub.read_uids[id] = MSGQ_READER_CLAIMING;
+  *pub.read_pids[id] = 0x7ffffffe;
+  msgq_init_subscriber(&sub2);
+  REQUIRE(sub2.reader_id != id);
+  REQUIRE(*pub.read_uids[id] == MSGQ_READER_CLAIMING);
+
+  for (auto q : {&pub, &sub1, &sub2}) msgq_close_queue(q);
+  remove((msgq_shm_dir() + "/test_reader_claim").c_str());
+}
+
+TEST_CASE("msgq_init_subscriber evicts lagging readers before new ones"){
+  remove((msgq_shm_dir() + "/test_reader_evict").c_str());
+  msgq_queue_t pub;
+  msgq_new_queue(&pub, "test_reader_evict", 1024 * 1024);
+  msgq_init_publisher(&pub);
+
+  std::vector<msgq_queue_t> subs(NUM_READERS + 2);
+  for (auto &q : subs) msgq_new_queue(&q, "test_reader_evict", 1024 * 1024);
+  for (int i = 0; i < NUM_READERS; i++) msgq_init_subscriber(&subs[i]);
+
+  // Every existing reader is behind
+  uint64_t value = 0;
+  msgq_msg_t msg;
+  msgq_msg_init_data(&msg, (char*)&value, sizeof(value));
+  REQUIRE(msgq_msg_send(&msg, &pub) == sizeof(value));
+  msgq_msg_close(&msg);
+
+  msgq_queue_t &a = subs[NUM_READERS], &b = subs[NUM_READERS + 1];
+  msgq_init_subscriber(&a);
+  msgq_init_subscriber(&b);
+  REQUIRE(a.reader_id != b.reader_id);
+  REQUIRE(*pub.read_uids[a.reader_id] == a.read_uid_local);
+  REQUIRE(*pub.read_uids[b.reader_id] == b.read_uid_local);
+
+  msgq_close_queue(&pub);
+  for (auto &q : subs) msgq_close_queue(&q);
+  remove((msgq_shm_dir() + "/test_reader_evict").c_str());
+}
+
+TEST_CASE("msgq leases detect overwrites and hold the reader until released"){
+  remove((msgq_shm_dir() + "/test_lease").c_str());
+  msgq_queue_t pub, sub;
+  msgq_new_queue(&pub, "test_lease", 1024 * 1024);
+  msgq_new_queue(&sub, "test_lease", 1024 * 1024);
+  msgq_init_publisher(&pub);
+  msgq_init_subscriber(&sub);
+
+  std::vector<char> data(100 * 1024, 1);
+  msgq_msg_t msg;
+  msgq_msg_init_data(&msg, data.data(), data.size());
+  REQUIRE(msgq_msg_send(&msg, &pub) == (int)data.size());
+  msgq_msg_close(&msg);
+
+  msgq_msg_t leased;
+  REQUIRE(msgq_msg_recv_lease(&leased, &sub) == (int)data.size());
+  REQUIRE(leased.data[0] == 1);
+  REQUIRE(msgq_msg_lease_valid(&sub));
+  REQUIRE_FALSE(msgq_all_readers_updated(&pub));
+
+  SECTION("release"){
+    msgq_msg_release(&sub);
+    REQUIRE(msgq_all_readers_updated(&pub));
+  }
+
+  SECTION("torn by a write in progress"){
+    // Reserve and commit until a reservation covers the leased message, then it's torn before the commit
+    int reserved = 0;
+    msgq_msg_t slot;
+    while (msgq_msg_lease_valid(&sub)){
+      REQUIRE(++reserved < 20);
+      slot.size = data.size();
+      REQUIRE(msgq_msg_reserve(&slot, &pub) == (int)data.size());
+      memset(slot.data, 2, slot.size);
+      if (msgq_msg_lease_valid(&sub)) REQUIRE(msgq_msg_commit(&slot, &pub) == (int)data.size());
+    }
+    REQUIRE(leased.data[0] == 2);
+    REQUIRE(msgq_msg_commit(&slot, &pub) == (int)data.size());
+  }
+
+  SECTION("overwritten"){
+    for (int i = 0; i < 20; i++){
+      msgq_msg_init_data(&msg, data.data(), data.size());
+      REQUIRE(msgq_msg_send(&msg, &pub) == (int)data.size());
+      msgq_msg_close(&msg);
+    }
+    REQUIRE_FALSE(msgq_msg_lease_valid(&sub));
+
+    // The reader starts over at the write pointer
+    msgq_msg_release(&sub);
+    REQUIRE(msgq_msg_recv_lease(&leased, &sub) == 0);
+  }
+
+  msgq_close_queue(&pub);
+  msgq_close_queue(&sub);
+  remove((msgq_shm_dir() + "/test_lease").c_str());
+}
+
+TEST_CASE("msgq counts per reader stats"){
+  remove((msgq_shm_dir() + "/test_stats").c_str());
+  msgq_queue_t pub, sub;
+  msgq_new_queue(&pub, "test_stats", 1024 * 1024);
+  msgq_new_queue(&sub, "test_stats", 1024 * 1024);
+  msgq_init_publisher(&pub);
+  msgq_init_subscriber(&sub);
+
+  // Lap the reader
+  std::vector<char> data(100 * 1024);
+  for (int i = 0; i < 20; i++){
+    msgq_msg_t msg;
+    msgq_msg_init_data(&msg, data.data(), data.size());
+    REQUIRE(msgq_msg_send(&msg, &pub) == (int)data.size());
+    msgq_msg_close(&msg);
+  }
+  REQUIRE(pub.stats->writer.msgs_sent == 20);
+  REQUIRE(pub.stats->writer.bytes_sent == 20 * data.size());
+  REQUIRE(pub.stats->writer.wraparounds >= 1);
+
+  msgq_msg_t msg;
+  REQUIRE(msgq_msg_recv(&msg, &sub) == 0);
+  const msgq_reader_stats_t &stats = pub.stats->readers[sub.reader_id];
+  REQUIRE(stats.invalidations == 1);
+
+  msgq_msg_init_data(&msg, data.data(), data.size());
+  REQUIRE(msgq_msg_send(&msg, &pub) == (int)data.size());
+  msgq_msg_close(&msg);
+  REQUIRE(msgq_msg_recv(&msg, &sub) == (int)data.size());
+  msgq_msg_close(&msg);
+  REQUIRE(stats.msgs == 1);
+  REQUIRE(stats.lag_hist[0] == 0);
+
+  msgq_close_queue(&pub);
+  msgq_close_queue(&sub);
+  remove((msgq_shm_dir() + "/test_stats").c_str());
+}
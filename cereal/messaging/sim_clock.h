@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#define CLOCK_BOOTTIME CLOCK_MONOTONIC
+#endif
+
+// Simulated clock for running daemons over logs faster than real time.
+// Processes started with SIM_CLOCK=1 take the boot time from SIM_CLOCK_PATH,
+// which a replay driver advances with sim_clock_set. Everything else uses CLOCK_BOOTTIME.
+// Like the msgq queues, the clock is kept per OPENPILOT_PREFIX.
+#define SIM_CLOCK_PATH "/dev/shm/sim_clock"
+
+inline std::atomic<uint64_t> *sim_clock_map() {
+  std::string path = SIM_CLOCK_PATH;
+  const char *prefix = getenv("OPENPILOT_PREFIX");
+  if (prefix != nullptr && prefix[0] != '\0') {
+    std::string dir = std::string("/dev/shm/") + prefix;
+    mkdir(dir.c_str(), 0775);
+    path = dir + "/sim_clock";
+  }
+
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0664);
+  assert(fd >= 0);
+  int ret = ftruncate(fd, sizeof(uint64_t));
+  assert(ret == 0);
+  void *mem = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  assert(mem != MAP_FAILED);
+  return (std::atomic<uint64_t> *)mem;
+}
+
+inline std::atomic<uint64_t> *sim_clock() {
+  static std::atomic<uint64_t> *clock = []() -> std::atomic<uint64_t> * {
+    const char *env = getenv("SIM_CLOCK");
+    return (env != nullptr && strcmp(env, "1") == 0) ? sim_clock_map() : nullptr;
+  }();
+  return clock;
+}
+
+inline bool sim_clock_enabled() {
+  return sim_clock() != nullptr;
+}
+
+inline uint64_t sim_clock_nanos_since_boot() {
+  if (std::atomic<uint64_t> *clock = sim_clock()) {
+    return clock->load();
+  }
+  struct timespec t;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Used by the driver, works without SIM_CLOCK set
+inline void sim_clock_set(uint64_t nanos) {
+  static std::atomic<uint64_t> *clock = sim_clock_map();
+  clock->store(nanos);
+}
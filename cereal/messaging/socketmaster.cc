@@ -1,8 +1,13 @@
 #include <time.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <algorithm>
 #include <string>
+#include <chrono>
 #include <mutex>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
 
 #include "services.h"
 #include "messaging.h"
@@ -10,16 +15,29 @@
 const bool SIMULATION = (getenv("SIMULATION") != nullptr) && (std::string(getenv("SIMULATION")) == "1");
 
 static inline uint64_t nanos_since_boot() {
-  struct timespec t;
-  clock_gettime(CLOCK_BOOTTIME, &t);
-  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+  return sim_clock_nanos_since_boot();
 }
 
-static const service *get_service(const char *name) {
-  for (const auto &it : services) {
-    if (strcmp(it.name, name) == 0) return &it;
-  }
-  return nullptr;
+static int find_service_idx(const char *name) {
+  static const std::unordered_map<std::string_view, int> service_idx = [] {
+    std::unordered_map<std::string_view, int> m;
+    for (int i = 0; i < NUM_SERVICES; i++) m[services[i].name] = i;
+    return m;
+  }();
+  auto it = service_idx.find(name);
+  return it == service_idx.end() ? -1 : it->second;
+}
+
+static int get_service_idx(const char *name) {
+  int idx = find_service_idx(name);
+  if (idx < 0) throw std::out_of_range(std::string("unknown service ") + name);
+  return idx;
+}
+
+static std::vector<const char *> service_names(const std::vector<ServiceId> &ids) {
+  std::vector<const char *> names;
+  for (auto id : ids) names.push_back(services[static_cast<int>(id)].name);
+  return names;
 }
 
 static inline bool inList(const std::vector<const char *> &list, const char *value) {
@@ -44,26 +62,138 @@ private:
 
 MessageContext message_context;
 
-struct SubMaster::SubMessage {
-  std::string name;
-  SubSocket *socket = nullptr;
-  int freq = 0;
-  bool updated = false, alive = false, valid = true, ignore_alive;
-  uint64_t rcv_time = 0, rcv_frame = 0;
-  void *allocated_msg_reader = nullptr;
-  capnp::FlatArrayMessageReader *msg_reader = nullptr;
-  AlignedBuffer aligned_buf;
-  cereal::Event::Reader event;
-};
+static capnp::ReaderOptions reader_options() {
+  capnp::ReaderOptions options;
+  options.traversalLimitInWords = kj::maxValue; // Don't limit
+  return options;
+}
+
+// Parse in place when the transport hands out word aligned data, otherwise copy
+static kj::ArrayPtr<const capnp::word> message_words(Message *msg, AlignedBuffer &aligned_buf) {
+  char *data = msg->getData();
+  size_t size = msg->getSize();
+  if (((uintptr_t)data % sizeof(capnp::word)) == 0 && (size % sizeof(capnp::word)) == 0) {
+    return kj::ArrayPtr<const capnp::word>((const capnp::word *)data, size / sizeof(capnp::word));
+  }
+  return aligned_buf.align(msg);
+}
+
+int receive_leased(SubSocket *sock, const std::function<void(cereal::Event::Reader &)> &fn, bool non_blocking) {
+  Message *msg = sock->receive_lease(non_blocking);
+  if (msg == nullptr) return 0;
+
+  bool valid = true;
+  try {
+    AlignedBuffer aligned_buf;
+    capnp::FlatArrayMessageReader reader(message_words(msg, aligned_buf), reader_options());
+    cereal::Event::Reader event = reader.getRoot<cereal::Event>();
+    fn(event);
+  } catch (const kj::Exception &e) {
+    // a torn message can fail to decode
+    valid = false;
+  }
+
+  // Checked after fn is done with the data
+  valid = sock->lease_valid() && valid;
+  sock->release_lease();
+  delete msg;
+  return valid ? 1 : -1;
+}
+
+HubEvent::HubEvent(Message *msg, uint64_t seq)
+  : msg(msg), reader(message_words(msg, aligned_buf), reader_options()), event(reader.getRoot<cereal::Event>()), seq(seq) {}
+
+SubHub &SubHub::instance() {
+  static SubHub hub;
+  return hub;
+}
+
+void SubHub::subscribe(int service, const char *address) {
+  std::unique_lock<std::mutex> lk(lock_);
+  // The poller and socket map are used without the lock while polling
+  cv_.wait(lk, [&]() { return !polling_; });
+  if (service_sockets_[service] != nullptr) return;
+
+  if (poller_ == nullptr) poller_ = Poller::create();
+  SubSocket *socket = SubSocket::create(message_context.context(), services[service].name, address ? address : "127.0.0.1", true);
+  assert(socket != 0);
+  poller_->registerSocket(socket);
+  sockets_[socket] = service;
+  service_sockets_[service] = socket;
+}
+
+uint64_t SubHub::update(const std::vector<int> &services, uint64_t seq, int timeout,
+                        std::vector<std::shared_ptr<const HubEvent>> &events) {
+  std::unique_lock<std::mutex> lk(lock_);
+
+  auto has_new = [&]() {
+    for (int s : services) {
+      if (latest_[s] && latest_[s]->seq > seq) return true;
+    }
+    return false;
+  };
+
+  // Another SubMaster may already have received what we are waiting for
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+  int wait = 0;
+  while (poller_ != nullptr) {
+    if (!polling_) {
+      polling_ = true;
+      lk.unlock();
+
+      std::vector<std::pair<int, std::shared_ptr<HubEvent>>> received;
+      for (auto s : poller_->poll(wait)) {
+        Message *msg = s->receive(true);
+        if (msg == nullptr) continue;
+        received.push_back({sockets_.at(s), std::make_shared<HubEvent>(msg, 0)});
+      }
+
+      lk.lock();
+      for (auto &[service, event] : received) {
+        event->seq = ++seq_;
+        latest_[service] = event;
+      }
+      polling_ = false;
+      cv_.notify_all();
+    } else if (timeout != 0) {
+      // Another SubMaster is polling, it wakes us up when it published what it received
+      if (timeout < 0) {
+        cv_.wait(lk);
+      } else {
+        cv_.wait_until(lk, deadline);
+      }
+    }
+    if (timeout == 0 || has_new()) break;
+
+    if (timeout > 0) {
+      wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+      if (wait <= 0) break;
+    } else {
+      wait = -1;
+    }
+  }
+
+  events.clear();
+  for (int s : services) events.push_back(latest_[s]);
+  return seq_;
+}
+
+SubHub::~SubHub() {
+  delete poller_;
+  for (auto &kv : sockets_) delete kv.first;
+}
 
 SubMaster::SubMaster(const std::vector<const char *> &service_list, const char *address,
-                     const std::vector<const char *> &ignore_alive) {
+                     const std::vector<const char *> &ignore_alive, const std::vector<const char *> &replay) {
   poller_ = Poller::create();
   for (auto name : service_list) {
-    const service *serv = get_service(name);
-    assert(serv != nullptr);
+    int idx = get_service_idx(name);
+    const service *serv = &services[idx];
     SubSocket *socket = SubSocket::create(message_context.context(), name, address ? address : "127.0.0.1", true);
     assert(socket != 0);
+    if (inList(replay, name)) {
+      socket->rewind(1);
+    }
     poller_->registerSocket(socket);
     SubMessage *m = new SubMessage{
       .name = name,
@@ -72,46 +202,127 @@ SubMaster::SubMaster(const std::vector<const char *> &service_list, const char *
       .ignore_alive = inList(ignore_alive, name),
       .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader))};
     m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
-    messages_[socket] = m;
-    services_[name] = m;
+    messages_.push_back(m);
+    sockets_[socket] = m;
+    services_[idx] = m;
+  }
+}
+
+SubMaster::SubMaster(SubHub &hub, const std::vector<const char *> &service_list, const std::vector<const char *> &ignore_alive)
+  : hub_(&hub) {
+  for (auto name : service_list) {
+    int idx = get_service_idx(name);
+    hub.subscribe(idx, nullptr);
+    SubMessage *m = new SubMessage{
+      .name = name,
+      .freq = services[idx].frequency,
+      .ignore_alive = inList(ignore_alive, name),
+      .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader))};
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
+    messages_.push_back(m);
+    services_[idx] = m;
+    hub_services_.push_back(idx);
+  }
+
+  // Like a socket, only deliver what is received after we subscribed
+  drain();
+}
+
+SubMaster::SubMaster(const std::vector<const char *> &service_list, const std::vector<const char *> &ignore_alive, std::nullptr_t) {
+  for (auto name : service_list) {
+    int idx = get_service_idx(name);
+    SubMessage *m = new SubMessage{
+      .name = name,
+      .freq = services[idx].frequency,
+      .ignore_alive = inList(ignore_alive, name),
+      .allocated_msg_reader = malloc(sizeof(capnp::FlatArrayMessageReader))};
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader({});
+    messages_.push_back(m);
+    services_[idx] = m;
+  }
+}
+
+SubMaster::SubMaster(const std::vector<ServiceId> &service_list, const char *address,
+                     const std::vector<ServiceId> &ignore_alive, const std::vector<ServiceId> &replay)
+  : SubMaster(service_names(service_list), address, service_names(ignore_alive), service_names(replay)) {}
+
+void SubMaster::register_wake(SubSocket *sock) {
+  assert(hub_ == nullptr && poller_ != nullptr);
+  if (wake_sockets_.insert(sock).second) {
+    poller_->registerSocket(sock);
   }
 }
 
 void SubMaster::update(int timeout) {
-  for (auto &kv : messages_) kv.second->updated = false;
+  for (auto m : messages_) m->updated = false;
+
+  if (hub_ != nullptr) {
+    update_hub_(timeout);
+    return;
+  }
 
   auto sockets = poller_->poll(timeout);
   uint64_t current_time = nanos_since_boot();
 
-  std::vector<std::pair<std::string, cereal::Event::Reader>> messages;
+  std::vector<SubMessage *> messages;
 
   for (auto s : sockets) {
+    if (wake_sockets_.count(s)) continue;
+
+    // Copied, the event is read lazily until the next update. Use receive_leased for zero-copy.
     Message *msg = s->receive(true);
     if (msg == nullptr) continue;
 
-    SubMessage *m = messages_.at(s);
+    SubMessage *m = sockets_.at(s);
 
     m->msg_reader->~FlatArrayMessageReader();
-    capnp::ReaderOptions options;
-    options.traversalLimitInWords = kj::maxValue; // Don't limit
-    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(m->aligned_buf.align(msg), options);
-    delete msg;
-    messages.push_back({m->name, m->msg_reader->getRoot<cereal::Event>()});
+    m->msg_reader = new (m->allocated_msg_reader) capnp::FlatArrayMessageReader(message_words(msg, m->aligned_buf), reader_options());
+    delete m->msg;
+    m->msg = msg;
+    m->event = m->msg_reader->getRoot<cereal::Event>();
+    messages.push_back(m);
   }
 
-  update_msgs(current_time, messages);
+  update_msgs_(current_time, messages);
 }
 
-void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<std::string, cereal::Event::Reader>> &messages){
-  if (++frame == UINT64_MAX) frame = 1;
+void SubMaster::update_hub_(int timeout) {
+  std::vector<std::shared_ptr<const HubEvent>> events;
+  hub_seq_ = hub_->update(hub_services_, hub_seq_, timeout, events);
+  uint64_t current_time = nanos_since_boot();
+
+  std::vector<SubMessage *> messages;
+  for (size_t i = 0; i < events.size(); i++) {
+    SubMessage *m = services_[hub_services_[i]];
+    if (events[i] && events[i]->seq > m->hub_seq) {
+      m->hub_event = events[i];
+      m->hub_seq = events[i]->seq;
+      m->event = m->hub_event->event;
+      messages.push_back(m);
+    }
+  }
+
+  update_msgs_(current_time, messages);
+}
 
+void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<std::string, cereal::Event::Reader>> &messages){
+  std::vector<SubMessage *> updated;
   for(auto &kv : messages) {
-    auto m_find = services_.find(kv.first);
-    if (m_find == services_.end()){
+    int idx = find_service_idx(kv.first.c_str());
+    if (idx < 0 || services_[idx] == nullptr){
       continue;
     }
-    SubMessage *m = m_find->second;
+    SubMessage *m = services_[idx];
     m->event = kv.second;
+    updated.push_back(m);
+  }
+  update_msgs_(current_time, updated);
+}
+
+void SubMaster::update_msgs_(uint64_t current_time, const std::vector<SubMessage *> &messages){
+  if (++frame == UINT64_MAX) frame = 1;
+
+  for(SubMessage *m : messages) {
     m->updated = true;
     m->rcv_time = current_time;
     m->rcv_frame = frame;
@@ -120,8 +331,7 @@ void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<s
   }
 
   if (!SIMULATION) {
-    for (auto &kv : messages_) {
-      SubMessage *m = kv.second;
+    for (SubMessage *m : messages_) {
       m->alive = (m->freq <= (1e-5) || ((current_time - m->rcv_time) * (1e-9)) < (10.0 / m->freq));
     }
   }
@@ -129,8 +339,7 @@ void SubMaster::update_msgs(uint64_t current_time, const std::vector<std::pair<s
 
 bool SubMaster::all_(const std::vector<const char *> &service_list, bool valid, bool alive) {
   int found = 0;
-  for (auto &kv : messages_) {
-    SubMessage *m = kv.second;
+  for (SubMessage *m : messages_) {
     if (service_list.size() == 0 || inList(service_list, m->name.c_str())) {
       found += (!valid || m->valid) && (!alive || (m->alive || m->ignore_alive));
     }
@@ -139,8 +348,18 @@ bool SubMaster::all_(const std::vector<const char *> &service_list, bool valid,
 }
 
 void SubMaster::drain() {
+  if (hub_ != nullptr) {
+    std::vector<std::shared_ptr<const HubEvent>> events;
+    hub_seq_ = hub_->update(hub_services_, UINT64_MAX, 0, events);
+    for (size_t i = 0; i < events.size(); i++) {
+      if (events[i]) services_[hub_services_[i]]->hub_seq = events[i]->seq;
+    }
+    return;
+  }
+
   while (true) {
     auto polls = poller_->poll(0);
+    polls.erase(std::remove_if(polls.begin(), polls.end(), [&](SubSocket *s) { return wake_sockets_.count(s) > 0; }), polls.end());
     if (polls.size() == 0)
       break;
 
@@ -151,55 +370,157 @@ void SubMaster::drain() {
   }
 }
 
+SubMaster::SubMessage *SubMaster::at(const char *name) const {
+  int idx = get_service_idx(name);
+  return at(static_cast<ServiceId>(idx));
+}
+
 bool SubMaster::updated(const char *name) const {
-  return services_.at(name)->updated;
+  return at(name)->updated;
 }
 
 bool SubMaster::alive(const char *name) const {
-  return services_.at(name)->alive;
+  return at(name)->alive;
 }
 
 bool SubMaster::valid(const char *name) const {
-  return services_.at(name)->valid;
+  return at(name)->valid;
 }
 
 uint64_t SubMaster::rcv_frame(const char *name) const {
-  return services_.at(name)->rcv_frame;
+  return at(name)->rcv_frame;
 }
 
 uint64_t SubMaster::rcv_time(const char *name) const {
-  return services_.at(name)->rcv_time;
+  return at(name)->rcv_time;
 }
 
 cereal::Event::Reader &SubMaster::operator[](const char *name) const {
-  return services_.at(name)->event;
+  return at(name)->event;
 };
 
 SubMaster::~SubMaster() {
   delete poller_;
-  for (auto &kv : messages_) {
-    SubMessage *m = kv.second;
+  for (SubMessage *m : messages_) {
     m->msg_reader->~FlatArrayMessageReader();
     free(m->allocated_msg_reader);
+    delete m->msg;
     delete m->socket;
     delete m;
   }
 }
 
+MergeReceiver::MergeReceiver(const std::vector<const char *> &service_list, uint64_t reorder_window_ns,
+                             const std::vector<const char *> &ignore_alive, const char *address)
+  : status(service_list, ignore_alive, nullptr), window_(reorder_window_ns) {
+  poller_ = Poller::create();
+  for (auto name : service_list) {
+    int idx = get_service_idx(name);
+    // Not conflating, every message goes through the reorder buffer
+    SubSocket *socket = SubSocket::create(message_context.context(), name, address ? address : "127.0.0.1", false);
+    assert(socket != 0);
+    poller_->registerSocket(socket);
+    sockets_[socket] = idx;
+    if ((uint64_t)services[idx].frequency * window_ >= 1000000000ULL) {
+      latest_[idx] = 0;
+    }
+  }
+}
+
+const std::vector<std::pair<std::string, cereal::Event::Reader>> &MergeReceiver::receive(int timeout) {
+  released_.clear();
+  events_.clear();
+
+  // Don't sleep past the moment the oldest pending message has to go out
+  if (!pending_.empty()) {
+    uint64_t now = nanos_since_boot();
+    uint64_t release = pending_.top().rcv_time + window_;
+    int wait = release > now ? (release - now + 999999) / 1000000 : 0;
+    timeout = timeout < 0 ? wait : std::min(timeout, wait);
+  }
+
+  for (auto s : poller_->poll(timeout)) {
+    Message *msg;
+    while ((msg = s->receive(true)) != nullptr) {
+      auto event = std::make_shared<const HubEvent>(msg, ++seq_);
+      uint64_t mono_time = event->event.getLogMonoTime();
+      newest_ = std::max(newest_, mono_time);
+      int idx = sockets_.at(s);
+      if (auto it = latest_.find(idx); it != latest_.end()) {
+        it->second = std::max(it->second, mono_time);
+      }
+      pending_.push({mono_time, seq_, nanos_since_boot(), idx, event});
+    }
+  }
+
+  // Without another service to wait on only the window applies
+  auto caught_up = [&](const Pending &p) {
+    int waited = 0;
+    for (auto &[idx, latest] : latest_) {
+      if (idx == p.service) continue;
+      if (latest < p.mono_time) return false;
+      waited++;
+    }
+    return waited > 0;
+  };
+
+  uint64_t current_time = nanos_since_boot();
+  while (!pending_.empty()) {
+    const Pending &p = pending_.top();
+    if (p.mono_time + window_ > newest_ && p.rcv_time + window_ > current_time && !caught_up(p)) break;
+
+    released_.push_back(p.event);
+    events_.push_back({services[p.service].name, p.event->event});
+    pending_.pop();
+  }
+
+  status.update_msgs(current_time, events_);
+  return events_;
+}
+
+MergeReceiver::~MergeReceiver() {
+  delete poller_;
+  for (auto &kv : sockets_) delete kv.first;
+}
+
 PubMaster::PubMaster(const std::vector<const char *> &service_list) {
   for (auto name : service_list) {
-    assert(get_service(name) != nullptr);
+    int idx = get_service_idx(name);
     PubSocket *socket = PubSocket::create(message_context.context(), name);
     assert(socket);
-    sockets_[name] = socket;
+    sockets_[idx] = socket;
   }
 }
 
+PubMaster::PubMaster(const std::vector<ServiceId> &service_list) : PubMaster(service_names(service_list)) {}
+
+int PubMaster::send(const char *name, capnp::byte *data, size_t size) {
+  int idx = get_service_idx(name);
+  return send(static_cast<ServiceId>(idx), data, size);
+}
+
 int PubMaster::send(const char *name, MessageBuilder &msg) {
-  auto bytes = msg.toBytes();
-  return send(name, bytes.begin(), bytes.size());
+  int idx = get_service_idx(name);
+  return send(static_cast<ServiceId>(idx), msg);
+}
+
+int PubMaster::send(ServiceId id, MessageBuilder &msg) {
+  // Serialize straight into the socket's buffer instead of a flat array copy
+  PubSocket *socket = at(id);
+  size_t size = capnp::computeSerializedSizeInWords(msg) * sizeof(capnp::word);
+  char *buf = socket->reserve(size);
+  if (buf == nullptr) return -1;
+
+  kj::ArrayOutputStream stream(kj::arrayPtr((capnp::byte *)buf, size));
+  capnp::writeMessage(stream, msg);
+  return socket->commit(size);
+}
+
+bool PubMaster::wait_readers_updated(const char *name, int timeout_ms) {
+  int idx = get_service_idx(name);
+  return wait_readers_updated(static_cast<ServiceId>(idx), timeout_ms);
 }
 
 PubMaster::~PubMaster() {
-  for (auto s : sockets_) delete s.second;
+  for (auto s : sockets_) delete s;
 }
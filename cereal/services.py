@@ -12,12 +12,33 @@ def new_port(port: int):
   return port + 1 if port >= RESERVED_PORT else port
 
 
+# msgq ring sizing: enough room for RING_SECONDS of messages at the service frequency and
+# at least RING_MIN_MSGS of them, rounded up to a power of two between RING_MIN_SIZE and RING_MAX_SIZE.
+# A single message must stay below a third of the ring.
+RING_SECONDS = 5
+RING_MIN_MSGS = 16
+RING_MIN_SIZE = 1024 * 1024
+RING_MAX_SIZE = 10 * 1024 * 1024
+DEFAULT_MSG_SIZE = 4 * 1024
+
+
+def segment_size(name: str, frequency: float) -> int:
+  if name in segment_size_overrides:
+    return segment_size_overrides[name]
+
+  size = msg_sizes.get(name, DEFAULT_MSG_SIZE) * max(RING_MIN_MSGS, frequency * RING_SECONDS)
+  size = 1 << (int(size) - 1).bit_length()
+  return min(max(size, RING_MIN_SIZE), RING_MAX_SIZE)
+
+
 class Service:
-  def __init__(self, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None):
+  def __init__(self, name: str, port: int, should_log: bool, frequency: float, decimation: Optional[int] = None):
     self.port = port
     self.should_log = should_log
     self.frequency = frequency
     self.decimation = decimation
+    self.segment_size = segment_size(name, frequency)
+    self.multi_publisher = name in multi_publisher_services
 
 DCAM_FREQ = 10. if not TICI else 20.
 
@@ -68,7 +89,35 @@ services = {
   # debug
   "testJoystick": (False, 0.),
 }
-service_list = {name: Service(new_port(idx), *vals) for  # type: ignore
+
+# expected upper bound of the serialized message size in bytes, DEFAULT_MSG_SIZE if not listed
+msg_sizes = {
+  "can": 32 * 1024,
+  "sendcan": 16 * 1024,
+  "liveTracks": 16 * 1024,
+  "modelV2": 64 * 1024,
+  "logMessage": 64 * 1024,
+  "androidLog": 64 * 1024,
+  "procLog": 256 * 1024,
+  "thumbnail": 256 * 1024,
+  "navRoute": 256 * 1024,
+  "ubloxRaw": 8 * 1024,
+}
+
+# explicit ring sizes in bytes, camera states carry full frames when the debug send env vars are set
+segment_size_overrides = {
+  "roadCameraState": 100 * 1024 * 1024,
+  "driverCameraState": 100 * 1024 * 1024,
+  "wideRoadCameraState": 100 * 1024 * 1024,
+}
+
+# services that can have several msgq publishers at the same time
+multi_publisher_services = {
+  "logMessage",
+  "testJoystick",
+}
+
+service_list = {name: Service(name, new_port(idx), *vals) for  # type: ignore
                 idx, (name, vals) in enumerate(services.items())}
 
 
@@ -77,14 +126,20 @@ def build_header():
   h += "/* THIS IS AN AUTOGENERATED FILE, PLEASE EDIT services.py */\n"
   h += "#ifndef __SERVICES_H\n"
   h += "#define __SERVICES_H\n"
-  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; };\n"
+  h += "struct service { char name[0x100]; int port; bool should_log; int frequency; int decimation; int segment_size; bool multi_publisher; };\n"
   h += "static struct service services[] = {\n"
   for k, v in service_list.items():
     should_log = "true" if v.should_log else "false"
     decimation = -1 if v.decimation is None else v.decimation
-    h += '  { "%s", %d, %s, %d, %d },\n' % \
-         (k, v.port, should_log, v.frequency, decimation)
+    multi_publisher = "true" if v.multi_publisher else "false"
+    h += '  { "%s", %d, %s, %d, %d, %d, %s },\n' % \
+         (k, v.port, should_log, v.frequency, decimation, v.segment_size, multi_publisher)
+  h += "};\n"
+  h += "enum class ServiceId : int {\n"
+  for k in service_list.keys():
+    h += '  %s,\n' % k
   h += "};\n"
+  h += "const int NUM_SERVICES = %d;\n" % len(service_list)
   h += "#endif\n"
   return h
 
@@ -17,6 +17,15 @@
 
 #include "ipc.h"
 
+std::string get_ipc_path(const std::string &name) {
+  std::string path = "/tmp/";
+  const char *prefix = getenv("OPENPILOT_PREFIX");
+  if (prefix != NULL && prefix[0] != '\0') {
+    path += std::string(prefix) + "_";
+  }
+  return path + "visionipc_" + name;
+}
+
 int ipc_connect(const char* socket_path) {
   int err;
 
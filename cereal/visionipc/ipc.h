@@ -1,5 +1,9 @@
 #pragma once
 #include <cstddef>
+#include <string>
+
+// Socket path of a VisionIPC server, includes OPENPILOT_PREFIX when set
+std::string get_ipc_path(const std::string &name);
 
 int ipc_connect(const char* socket_path);
 int ipc_bind(const char* socket_path);
@@ -0,0 +1,58 @@
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <unistd.h>
+
+#include "visionipc/visionipc_client.h"
+#include "visionipc/visionipc_recorder.h"
+
+// Records the raw frames of a VisionIPC stream for vipc_replay
+// usage: vipc_record <server name> <stream type> <path> [--frames N]
+
+volatile sig_atomic_t do_exit = 0;
+
+static void sig_handler(int signal) {
+  do_exit = 1;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    printf("usage: %s <server name> <stream type> <path> [--frames N]\n", argv[0]);
+    return 1;
+  }
+  std::signal(SIGINT, sig_handler);
+  std::signal(SIGTERM, sig_handler);
+
+  std::string name = argv[1];
+  VisionStreamType type = (VisionStreamType)atoi(argv[2]);
+  std::string path = argv[3];
+  size_t max_frames = 0;
+  for (int i = 4; i < argc - 1; i++) {
+    if (strcmp(argv[i], "--frames") == 0) max_frames = strtoul(argv[i + 1], NULL, 10);
+  }
+
+  VisionIpcClient client(name, type, false);
+  while (!do_exit && !client.connect(false)) {
+    usleep(100000);
+  }
+
+  std::unique_ptr<VisionIpcRecorder> recorder;
+  while (!do_exit && (max_frames == 0 || !recorder || recorder->size() < max_frames)) {
+    VisionIpcBufExtra extra;
+    VisionBuf *buf = client.recv(&extra);
+    if (buf == nullptr) continue;
+
+    if (!recorder) recorder = std::make_unique<VisionIpcRecorder>(path, buf);
+    recorder->write(buf, extra);
+  }
+
+  if (recorder) {
+    recorder->close();
+    printf("recorded %zu frames to %s\n", recorder->size(), path.c_str());
+  }
+  return 0;
+}
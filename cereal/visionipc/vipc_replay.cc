@@ -0,0 +1,75 @@
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "visionipc/visionipc_recorder.h"
+
+// Serves recordings of vipc_record, one stream per file, frame i of all files together.
+// Paced by the recorded timestamp_eof (scaled by --speed), a fixed --fps,
+// or --lockstep: the next frame is sent once every client received the last one.
+// usage: vipc_replay <server name> <path>... [--speed S] [--fps F] [--lockstep] [--loop]
+
+volatile sig_atomic_t do_exit = 0;
+
+static void sig_handler(int signal) {
+  do_exit = 1;
+}
+
+int main(int argc, char** argv) {
+  std::signal(SIGINT, sig_handler);
+  std::signal(SIGTERM, sig_handler);
+
+  std::vector<std::string> paths;
+  double speed = 1.0, fps = 0;
+  bool lockstep = false, loop = false;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+      speed = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+      fps = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--lockstep") == 0) {
+      lockstep = true;
+    } else if (strcmp(argv[i], "--loop") == 0) {
+      loop = true;
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (argc < 3 || paths.empty()) {
+    printf("usage: %s <server name> <path>... [--speed S] [--fps F] [--lockstep] [--loop]\n", argv[0]);
+    return 1;
+  }
+  if (lockstep && messaging_use_zmq()) {
+    printf("--lockstep needs msgq, ZMQ publishers can't tell what their subscribers received\n");
+    return 1;
+  }
+
+  VisionIpcPlayer player(argv[1], paths);
+  size_t num_frames = player.size();
+  printf("serving %zu frames\n", num_frames);
+  if (num_frames == 0) return 0;
+
+  do {
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < num_frames && !do_exit; i++) {
+      if (lockstep) {
+        player.send(i);
+        while (!do_exit && !player.wait_clients(100)) {}
+        continue;
+      }
+
+      double t = (fps > 0) ? i / fps : (player.timestamp(i) - player.timestamp(0)) * 1e-9 / speed;
+      if (fps > 0 || speed > 0) {
+        std::this_thread::sleep_until(start + std::chrono::duration<double>(t));
+      }
+      player.send(i);
+    }
+  } while (loop && !do_exit);
+
+  return 0;
+}
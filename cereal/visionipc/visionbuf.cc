@@ -1,5 +1,14 @@
 #include "visionbuf.h"
 
+#include <cassert>
+#include <ctime>
+
+#include "libyuv.h"
+
+#ifdef __APPLE__
+#define CLOCK_BOOTTIME CLOCK_MONOTONIC
+#endif
+
 #define ALIGN(x, align) (((x) + (align)-1) & ~((align)-1))
 
 #ifdef QCOM
@@ -22,6 +31,18 @@ void visionbuf_compute_aligned_width_and_height(int width, int height, int *alig
 #endif
 }
 
+// Box filter, dst has to be smaller than src
+void visionbuf_downscale_yuv(const VisionBuf *src, VisionBuf *dst) {
+  assert(!src->rgb && !dst->rgb);
+  assert(dst->width <= src->width && dst->height <= src->height);
+
+  int err = libyuv::I420Scale(src->y, src->width, src->u, src->width / 2, src->v, src->width / 2,
+                              src->width, src->height,
+                              dst->y, dst->width, dst->u, dst->width / 2, dst->v, dst->width / 2,
+                              dst->width, dst->height, libyuv::kFilterBox);
+  assert(err == 0);
+}
+
 void VisionBuf::init_rgb(size_t init_width, size_t init_height, size_t init_stride) {
   this->rgb = true;
   this->width = init_width;
@@ -39,6 +60,20 @@ void VisionBuf::init_yuv(size_t init_width, size_t init_height){
   this->v = this->u + (this->width / 2 * this->height / 2);
 }
 
+void VisionBuf::set_dirty(int dir) {
+  this->dirty |= 1 << dir;
+}
+
+bool VisionBuf::is_dirty(int dir) {
+  return this->dirty & (1 << dir);
+}
+
+// Clears the dirty bit, buffers without dirty tracking always sync
+bool VisionBuf::needs_sync(int dir) {
+  bool ret = !this->track_dirty || this->is_dirty(dir);
+  this->dirty &= ~(1 << dir);
+  return ret;
+}
 
 uint64_t VisionBuf::get_frame_id() {
   return *frame_id;
@@ -46,4 +81,30 @@ uint64_t VisionBuf::get_frame_id() {
 
 void VisionBuf::set_frame_id(uint64_t id) {
   *frame_id = id;
+}
+
+static uint64_t lease_now() {
+  struct timespec t;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void VisionBuf::acquire_lease() {
+  lease->time = lease_now();
+  lease->count++;
+}
+
+void VisionBuf::release_lease() {
+  // The server may have reset a stale lease in the meantime
+  uint32_t count = lease->count;
+  while (count > 0 && !lease->count.compare_exchange_weak(count, count - 1)) {}
+}
+
+bool VisionBuf::is_leased() {
+  uint32_t count = lease->count;
+  if (count == 0) return false;
+  if (lease_now() - lease->time < VISIONBUF_LEASE_TIMEOUT_NS) return true;
+
+  // Reset the stale lease, unless a client changed it in the meantime
+  return !lease->count.compare_exchange_strong(count, 0);
 }
\ No newline at end of file
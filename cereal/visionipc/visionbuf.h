@@ -1,4 +1,7 @@
 #pragma once
+#include <atomic>
+#include <cassert>
+
 #include "visionipc.h"
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
@@ -10,6 +13,21 @@
 
 #define VISIONBUF_SYNC_FROM_DEVICE 0
 #define VISIONBUF_SYNC_TO_DEVICE 1
+#define VISIONBUF_LEASE_TIMEOUT_NS (1000ULL * 1000 * 1000)
+
+// Clients reading the buffer, kept in shared memory after the frame id. VisionIpcServer
+// doesn't hand out leased buffers. Leases older than VISIONBUF_LEASE_TIMEOUT_NS are ignored,
+// so a client that died while holding one doesn't pin the buffer.
+struct VisionBufLease {
+  std::atomic<uint32_t> count;
+  std::atomic<uint64_t> time;
+  std::atomic<uint64_t> generation;  // bumped each time VisionIpcServer hands the buffer out
+};
+
+// The lease follows the frame id stored at frame_id_offset
+inline size_t visionbuf_lease_offset(size_t frame_id_offset) {
+  return (frame_id_offset + sizeof(uint64_t) + 7) & ~(size_t)7;
+}
 
 enum VisionStreamType {
   VISION_STREAM_RGB_BACK,
@@ -18,15 +36,32 @@ enum VisionStreamType {
   VISION_STREAM_YUV_BACK,
   VISION_STREAM_YUV_FRONT,
   VISION_STREAM_YUV_WIDE,
+  // Downscaled copies of the YUV streams, see VisionIpcServer::create_pyramid
+  VISION_STREAM_YUV_BACK_HALF,
+  VISION_STREAM_YUV_BACK_QUARTER,
+  VISION_STREAM_YUV_FRONT_HALF,
+  VISION_STREAM_YUV_FRONT_QUARTER,
+  VISION_STREAM_YUV_WIDE_HALF,
+  VISION_STREAM_YUV_WIDE_QUARTER,
   VISION_STREAM_MAX,
 };
 
+#define VISIONBUF_PYRAMID_LEVELS 2
+
+// Stream of a YUV stream downscaled by 2^level, level 1 is half and 2 quarter resolution
+inline VisionStreamType visionbuf_pyramid_type(VisionStreamType type, int level) {
+  assert(type >= VISION_STREAM_YUV_BACK && type <= VISION_STREAM_YUV_WIDE);
+  assert(level >= 1 && level <= VISIONBUF_PYRAMID_LEVELS);
+  return (VisionStreamType)(VISION_STREAM_YUV_BACK_HALF + (type - VISION_STREAM_YUV_BACK) * VISIONBUF_PYRAMID_LEVELS + level - 1);
+}
+
 class VisionBuf {
  public:
   size_t len = 0;
   size_t mmap_len = 0;
   void * addr = nullptr;
   uint64_t *frame_id;
+  VisionBufLease *lease = nullptr;
   int fd = 0;
 
   bool rgb = false;
@@ -47,6 +82,11 @@ class VisionBuf {
   // OpenCL
   cl_mem buf_cl = nullptr;
   cl_command_queue copy_q = nullptr;
+  bool host_unified = false;
+
+  // With dirty tracking sync() only does work in a direction marked with set_dirty
+  bool track_dirty = false;
+  int dirty = 0;
 
   // ion
   int handle = 0;
@@ -59,8 +99,17 @@ class VisionBuf {
   int sync(int dir);
   int free();
 
+  void set_dirty(int dir);
+  bool is_dirty(int dir);
+  bool needs_sync(int dir);
+
   void set_frame_id(uint64_t id);
   uint64_t get_frame_id();
+
+  void acquire_lease();
+  void release_lease();
+  bool is_leased();
 };
 
 void visionbuf_compute_aligned_width_and_height(int width, int height, int *aligned_w, int *aligned_h);
+void visionbuf_downscale_yuv(const VisionBuf *src, VisionBuf *dst);
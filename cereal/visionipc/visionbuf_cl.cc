@@ -11,32 +11,81 @@
 
 std::atomic<int> offset = 0;
 
-static void *malloc_with_fd(size_t len, int *fd) {
+#define VISIONBUF_HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static int open_shm(size_t *len) {
   char full_path[0x100];
+  int fd = -1;
+
+#ifndef __APPLE__
+  // Opt-in hugetlb pages, needs pages reserved in /proc/sys/vm/nr_hugepages.
+  // Sealed so clients can't resize the buffer under the server.
+  static const bool use_hugepages = getenv("VISIONBUF_HUGEPAGES") != NULL;
+  if (use_hugepages && *len >= VISIONBUF_HUGEPAGE_SIZE) {
+    size_t huge_len = (*len + VISIONBUF_HUGEPAGE_SIZE - 1) & ~(size_t)(VISIONBUF_HUGEPAGE_SIZE - 1);
+    fd = memfd_create("visionbuf", MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_HUGETLB);
+    if (fd >= 0 && ftruncate(fd, huge_len) == 0) {
+      *len = huge_len;
+      return fd;
+    }
+    if (fd >= 0) close(fd);
+  }
+
+  fd = memfd_create("visionbuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd >= 0) {
+    if (ftruncate(fd, *len) == 0) return fd;
+    close(fd);
+  }
+#endif
 
+  // memfd not available or failed
 #ifdef __APPLE__
   snprintf(full_path, sizeof(full_path)-1, "/tmp/visionbuf_%d_%d", getpid(), offset++);
 #else
   snprintf(full_path, sizeof(full_path)-1, "/dev/shm/visionbuf_%d_%d", getpid(), offset++);
 #endif
 
-  *fd = open(full_path, O_RDWR | O_CREAT, 0664);
-  assert(*fd >= 0);
+  fd = open(full_path, O_RDWR | O_CREAT, 0664);
+  assert(fd >= 0);
 
   unlink(full_path);
 
-  ftruncate(*fd, len);
-  void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  int err = ftruncate(fd, *len);
+  assert(err == 0);
+  return fd;
+}
+
+static void *malloc_with_fd(size_t *len, int *fd) {
+  *fd = open_shm(len);
+
+#ifdef F_SEAL_SEAL
+  fcntl(*fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
+
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  flags |= MAP_POPULATE;
+#endif
+  void *addr = mmap(NULL, *len, PROT_READ | PROT_WRITE, flags, *fd, 0);
   assert(addr != MAP_FAILED);
 
+#ifdef MADV_HUGEPAGE
+  // Transparent huge pages when hugetlb isn't available, only a hint
+  if (getenv("VISIONBUF_HUGEPAGES") != NULL) {
+    madvise(addr, *len, MADV_HUGEPAGE);
+  }
+#endif
+
   return addr;
 }
 
 void VisionBuf::allocate(size_t length) {
   this->len = length;
-  this->mmap_len = this->len;
-  this->addr = malloc_with_fd(this->len, &this->fd);
+  this->mmap_len = visionbuf_lease_offset(this->len) + sizeof(VisionBufLease);
+  this->addr = malloc_with_fd(&this->mmap_len, &this->fd);
   this->frame_id = (uint64_t*)((uint8_t*)this->addr + this->len);
+  this->lease = (VisionBufLease*)((uint8_t*)this->addr + visionbuf_lease_offset(this->len));
+  this->lease->count = 0;
 }
 
 void VisionBuf::init_cl(cl_device_id device_id, cl_context ctx){
@@ -47,6 +96,13 @@ void VisionBuf::init_cl(cl_device_id device_id, cl_context ctx){
 
   this->buf_cl = clCreateBuffer(ctx, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, this->len, this->addr, &err);
   assert(err == 0);
+
+  // CPU devices and integrated GPUs can use the host pointer directly
+  cl_bool unified = CL_FALSE;
+  cl_device_type type = 0;
+  clGetDeviceInfo(device_id, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL);
+  clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+  this->host_unified = unified || (type & CL_DEVICE_TYPE_CPU);
 }
 
 
@@ -56,14 +112,23 @@ void VisionBuf::import(){
   assert(this->addr != MAP_FAILED);
 
   this->frame_id = (uint64_t*)((uint8_t*)this->addr + this->len);
+  this->lease = (VisionBufLease*)((uint8_t*)this->addr + visionbuf_lease_offset(this->len));
 }
 
 
 int VisionBuf::sync(int dir) {
   int err = 0;
-  if (!this->buf_cl) return 0;
-
-  if (dir == VISIONBUF_SYNC_FROM_DEVICE) {
+  if (!this->needs_sync(dir) || !this->buf_cl) return 0;
+
+  if (this->host_unified) {
+    // Mapping a CL_MEM_USE_HOST_PTR buffer is a synchronization point that doesn't copy
+    // when the device shares host memory
+    cl_map_flags flags = (dir == VISIONBUF_SYNC_FROM_DEVICE) ? CL_MAP_READ : CL_MAP_WRITE;
+    void *ptr = clEnqueueMapBuffer(this->copy_q, this->buf_cl, CL_TRUE, flags, 0, this->len, 0, NULL, NULL, &err);
+    if (err == 0) {
+      err = clEnqueueUnmapMemObject(this->copy_q, this->buf_cl, ptr, 0, NULL, NULL);
+    }
+  } else if (dir == VISIONBUF_SYNC_FROM_DEVICE) {
     err = clEnqueueReadBuffer(this->copy_q, this->buf_cl, CL_FALSE, 0, this->len, this->addr, 0, NULL, NULL);
   } else {
     err = clEnqueueWriteBuffer(this->copy_q, this->buf_cl, CL_FALSE, 0, this->len, this->addr, 0, NULL, NULL);
@@ -86,7 +151,7 @@ int VisionBuf::free() {
     if (err != 0) return err;
   }
 
-  err = munmap(this->addr, this->len);
+  err = munmap(this->addr, this->mmap_len);
   if (err != 0) return err;
 
   err = close(this->fd);
@@ -53,7 +53,7 @@ void VisionBuf::allocate(size_t length) {
   ion_init();
 
   struct ion_allocation_data ion_alloc = {0};
-  ion_alloc.len = length + PADDING_CL + sizeof(uint64_t);
+  ion_alloc.len = visionbuf_lease_offset(length + PADDING_CL) + sizeof(VisionBufLease);
   ion_alloc.align = 4096;
   ion_alloc.heap_id_mask = 1 << ION_IOMMU_HEAP_ID;
   ion_alloc.flags = ION_FLAG_CACHED;
@@ -79,6 +79,7 @@ void VisionBuf::allocate(size_t length) {
   this->handle = ion_alloc.handle;
   this->fd = ion_fd_data.fd;
   this->frame_id = (uint64_t*)((uint8_t*)this->addr + this->len + PADDING_CL);
+  this->lease = (VisionBufLease*)((uint8_t*)this->addr + visionbuf_lease_offset(this->len + PADDING_CL));
 }
 
 void VisionBuf::import(){
@@ -98,6 +99,7 @@ void VisionBuf::import(){
   assert(this->addr != MAP_FAILED);
 
   this->frame_id = (uint64_t*)((uint8_t*)this->addr + this->len + PADDING_CL);
+  this->lease = (VisionBufLease*)((uint8_t*)this->addr + visionbuf_lease_offset(this->len + PADDING_CL));
 }
 
 void VisionBuf::init_cl(cl_device_id device_id, cl_context ctx) {
@@ -119,6 +121,8 @@ void VisionBuf::init_cl(cl_device_id device_id, cl_context ctx) {
 
 
 int VisionBuf::sync(int dir) {
+  if (!this->needs_sync(dir)) return 0;
+
   struct ion_flush_data flush_data = {0};
   flush_data.handle = this->handle;
   flush_data.vaddr = this->addr;
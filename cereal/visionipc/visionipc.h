@@ -9,10 +9,12 @@ struct VisionIpcBufExtra {
   uint32_t frame_id;
   uint64_t timestamp_sof;
   uint64_t timestamp_eof;
+  uint64_t timestamp_sent;  // set by VisionIpcServer::send
 };
 
 struct VisionIpcPacket {
   uint64_t server_id;
   size_t idx;
+  uint64_t generation;  // of the buffer when it was sent, see VisionBufLease
   struct VisionIpcBufExtra extra;
 };
@@ -22,11 +22,13 @@ cdef extern from "visionipc.h":
     uint32_t frame_id
     uint64_t timestamp_sof
     uint64_t timestamp_eof
+    uint64_t timestamp_sent
 
 cdef extern from "visionipc_server.h":
   cdef cppclass VisionIpcServer:
     VisionIpcServer(string, void*, void*)
     void create_buffers(VisionStreamType, size_t, bool, size_t, size_t)
+    void create_pyramid(VisionStreamType, int, size_t)
     VisionBuf * get_buffer(VisionStreamType)
     void send(VisionBuf *, VisionIpcBufExtra *, bool)
     void start_listener()
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <chrono>
 #include <cassert>
 #include <iostream>
@@ -19,6 +20,7 @@ VisionIpcClient::VisionIpcClient(std::string name, VisionStreamType type, bool c
 // Connect is not thread safe. Do not use the buffers while calling connect
 bool VisionIpcClient::connect(bool blocking){
   connected = false;
+  release();
 
   // Cleanup old buffers on reconnect
   for (size_t i = 0; i < num_buffers; i++){
@@ -30,7 +32,7 @@ bool VisionIpcClient::connect(bool blocking){
   num_buffers = 0;
 
   // Connect to server socket and ask for all FDs of type
-  std::string path = "/tmp/visionipc_" + name;
+  std::string path = get_ipc_path(name);
 
   int socket_fd = -1;
   while (socket_fd < 0) {
@@ -62,6 +64,8 @@ bool VisionIpcClient::connect(bool blocking){
   for (size_t i = 0; i < num_buffers; i++){
     buffers[i] = bufs[i];
     buffers[i].fd = fds[i];
+    buffers[i].track_dirty = track_dirty;
+    buffers[i].dirty = 0;
     buffers[i].import();
     if (buffers[i].rgb) {
       buffers[i].init_rgb(buffers[i].width, buffers[i].height, buffers[i].stride);
@@ -78,9 +82,8 @@ bool VisionIpcClient::connect(bool blocking){
 }
 
 VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_ms){
-  auto p = poller->poll(timeout_ms);
-
-  if (!p.size()){
+  // Non-blocking receive doesn't need to poll first
+  if (timeout_ms != 0 && poller->poll(timeout_ms).size() == 0){
     return nullptr;
   }
 
@@ -102,11 +105,27 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
     return nullptr;
   }
 
+  // The server won't hand out this buffer again until we are done with it
+  release();
+  buf->acquire_lease();
+
+  // With a backlog the server may have handed the buffer out again before the lease was taken
+  if (buf->lease->generation != packet->generation){
+    buf->release_lease();
+    if (++overwritten == 1 || overwritten % 100 == 0){
+      LOGW("stream %d: buffer reused before it was received, dropped %lu frames", type, overwritten);
+    }
+    delete r;
+    return recv(extra, 0);
+  }
+
   if (extra) {
     *extra = packet->extra;
   }
+  leased = buf;
 
-  if (buf->sync(VISIONBUF_SYNC_TO_DEVICE) != 0) {
+  buf->set_dirty(VISIONBUF_SYNC_TO_DEVICE);
+  if (!track_dirty && buf->sync(VISIONBUF_SYNC_TO_DEVICE) != 0) {
     LOGE("Failed to sync buffer");
   }
 
@@ -116,7 +135,21 @@ VisionBuf * VisionIpcClient::recv(VisionIpcBufExtra * extra, const int timeout_m
 
 
 
+VisionBuf * VisionIpcClient::recv(SubMaster &sm, VisionIpcBufExtra * extra, const int timeout_ms){
+  sm.register_wake(sock);
+  sm.update(timeout_ms);
+  return recv(extra, 0);
+}
+
+void VisionIpcClient::release(){
+  if (leased != nullptr){
+    leased->release_lease();
+    leased = nullptr;
+  }
+}
+
 VisionIpcClient::~VisionIpcClient(){
+  release();
   for (size_t i = 0; i < num_buffers; i++){
     if (buffers[i].free() != 0) {
       LOGE("Failed to free buffer %zu", i);
@@ -127,3 +160,133 @@ VisionIpcClient::~VisionIpcClient(){
   delete poller;
   delete msg_ctx;
 }
+
+
+VisionIpcSyncClient::VisionIpcSyncClient(std::string name, const std::vector<VisionStreamType> &types, uint32_t max_skew, bool conflate,
+                                         cl_device_id device_id, cl_context ctx) : max_skew(max_skew), conflate(conflate) {
+  poller = Poller::create();
+  for (auto type : types){
+    // Not conflating, every frame is needed to find matches
+    clients.emplace_back(new VisionIpcClient(name, type, false, device_id, ctx));
+    poller->registerSocket(clients.back()->get_socket());
+  }
+  pending.resize(types.size());
+  dropped.resize(types.size(), 0);
+}
+
+bool VisionIpcSyncClient::connect(bool blocking){
+  release();
+  for (size_t i = 0; i < clients.size(); i++){
+    while (!pending[i].empty()) drop(i);
+    if (!clients[i]->connected && !clients[i]->connect(blocking)) return false;
+  }
+  return true;
+}
+
+bool VisionIpcSyncClient::is_connected(){
+  for (auto &c : clients){
+    if (!c->connected) return false;
+  }
+  return true;
+}
+
+void VisionIpcSyncClient::drop(size_t i){
+  pending[i].front().buf->release_lease();
+  pending[i].pop_front();
+  dropped[i]++;
+}
+
+void VisionIpcSyncClient::release(){
+  for (auto buf : leased) buf->release_lease();
+  leased.clear();
+}
+
+// Take everything the streams have ready, each pending frame holds its own lease
+void VisionIpcSyncClient::drain(){
+  for (size_t i = 0; i < clients.size(); i++){
+    VisionIpcBufExtra extra = {};
+    VisionBuf *buf;
+    while ((buf = clients[i]->recv(&extra, 0)) != nullptr){
+      buf->acquire_lease();
+      pending[i].push_back({buf, extra});
+
+      // A stream that falls behind can't hold on to more buffers than the server can spare
+      if (pending[i].size() > (size_t)clients[i]->num_buffers / 2 + 1) drop(i);
+    }
+  }
+}
+
+bool VisionIpcSyncClient::match(std::vector<VisionBuf*> &bufs, std::vector<VisionIpcBufExtra> *extras, bool accept_skew){
+  bool found = false;
+  while (true){
+    uint32_t target = 0;
+    for (auto &p : pending){
+      if (p.empty()) return found;
+      target = std::max(target, p.front().extra.frame_id);
+    }
+
+    // Frames too old to match the newest front can never be paired, and a frame
+    // is skipped when the next one is closer to the target
+    bool complete = true, moved = false;
+    uint32_t lowest = UINT32_MAX, highest = 0;
+    for (size_t i = 0; i < pending.size(); i++){
+      auto &p = pending[i];
+      while (!p.empty() && (p.front().extra.frame_id + max_skew < target ||
+                            (p.size() > 1 && p[1].extra.frame_id <= target))) drop(i);
+      if (p.empty()) return found;
+
+      uint32_t frame_id = p.front().extra.frame_id;
+      moved = moved || frame_id > target;
+      lowest = std::min(lowest, frame_id);
+      highest = std::max(highest, frame_id);
+      // Unless a later frame is pending, a closer one may still arrive
+      complete = complete && (frame_id == target || p.size() > 1 || accept_skew);
+    }
+    // Dropping moved a front past the target, match against the new one
+    if (moved) continue;
+    if (!complete || lowest + max_skew < highest) return found;
+
+    if (found){
+      for (size_t i = 0; i < leased.size(); i++){
+        leased[i]->release_lease();
+        dropped[i]++;
+      }
+    }
+
+    leased.clear();
+    bufs.clear();
+    if (extras) extras->clear();
+    for (auto &p : pending){
+      leased.push_back(p.front().buf);
+      bufs.push_back(p.front().buf);
+      if (extras) extras->push_back(p.front().extra);
+      p.pop_front();
+    }
+    found = true;
+
+    if (!conflate) return found;
+  }
+}
+
+bool VisionIpcSyncClient::recv(std::vector<VisionBuf*> &bufs, std::vector<VisionIpcBufExtra> *extras, const int timeout_ms){
+  release();
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+  while (true){
+    drain();
+    if (!is_connected()) return false;
+    if (match(bufs, extras)) return true;
+
+    int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+    if (timeout_ms >= 0 && remaining <= 0) return match(bufs, extras, true);
+    poller->poll(timeout_ms < 0 ? -1 : remaining);
+  }
+}
+
+VisionIpcSyncClient::~VisionIpcSyncClient(){
+  release();
+  for (size_t i = 0; i < pending.size(); i++){
+    while (!pending[i].empty()) drop(i);
+  }
+  delete poller;
+}
@@ -1,4 +1,6 @@
 #pragma once
+#include <deque>
+#include <memory>
 #include <vector>
 #include <string>
 #include <unistd.h>
@@ -21,13 +23,64 @@ private:
 
   void init_msgq(bool conflate);
 
+  // Buffer returned by the last recv, leased until the next recv or release
+  VisionBuf *leased = nullptr;
+
 public:
   bool connected = false;
+  // Defer the device sync of received frames to the first buf->sync(VISIONBUF_SYNC_TO_DEVICE),
+  // so frames only read on the CPU are never copied. Set before connect.
+  bool track_dirty = false;
   int num_buffers = 0;
+  // Frames whose buffer the server reused before recv leased it, these are dropped
+  uint64_t overwritten = 0;
   VisionBuf buffers[VISIONIPC_MAX_FDS];
   VisionIpcClient(std::string name, VisionStreamType type, bool conflate, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcClient();
   VisionBuf * recv(VisionIpcBufExtra * extra=nullptr, const int timeout_ms=100);
+  // Wait for a frame or a message of sm in one poll. sm is updated either way,
+  // returns the frame or nullptr if only messages arrived.
+  VisionBuf * recv(SubMaster &sm, VisionIpcBufExtra * extra=nullptr, const int timeout_ms=100);
+  // Notification socket, has a message when a frame is ready
+  SubSocket * get_socket() { return sock; }
   bool connect(bool blocking=true);
+  void release();
   bool is_connected() { return connected; }
 };
+
+// Receives several streams of a server and returns sets of frames with matching frame ids,
+// at most max_skew apart. Exact and closest matches are preferred, a set with skew is held
+// until a later frame shows no closer one is coming, or until recv times out.
+// Frames without a match are dropped and counted per stream.
+// All buffers of the returned set stay leased until the next recv.
+class VisionIpcSyncClient {
+private:
+  struct Frame {
+    VisionBuf *buf;
+    VisionIpcBufExtra extra;
+  };
+
+  uint32_t max_skew;
+  bool conflate;
+  Poller * poller;
+  std::vector<std::deque<Frame>> pending;
+  std::vector<VisionBuf*> leased;
+
+  void drain();
+  bool match(std::vector<VisionBuf*> &bufs, std::vector<VisionIpcBufExtra> *extras, bool accept_skew=false);
+  void drop(size_t i);
+  void release();
+
+public:
+  std::vector<std::unique_ptr<VisionIpcClient>> clients;
+  std::vector<uint64_t> dropped;
+
+  // With conflate only the newest matched set is returned, older ones count as dropped
+  VisionIpcSyncClient(std::string name, const std::vector<VisionStreamType> &types, uint32_t max_skew=0, bool conflate=true,
+                      cl_device_id device_id=nullptr, cl_context ctx=nullptr);
+  ~VisionIpcSyncClient();
+  bool connect(bool blocking=true);
+  bool is_connected();
+  // Fills bufs and extras in the order of types, returns false if no set was matched within timeout_ms
+  bool recv(std::vector<VisionBuf*> &bufs, std::vector<VisionIpcBufExtra> *extras=nullptr, const int timeout_ms=100);
+};
@@ -22,6 +22,12 @@ cpdef enum VisionStreamType:
   VISION_STREAM_YUV_BACK
   VISION_STREAM_YUV_FRONT
   VISION_STREAM_YUV_WIDE
+  VISION_STREAM_YUV_BACK_HALF
+  VISION_STREAM_YUV_BACK_QUARTER
+  VISION_STREAM_YUV_FRONT_HALF
+  VISION_STREAM_YUV_FRONT_QUARTER
+  VISION_STREAM_YUV_WIDE_HALF
+  VISION_STREAM_YUV_WIDE_QUARTER
 
 
 cdef class VisionIpcServer:
@@ -47,6 +53,9 @@ cdef class VisionIpcServer:
 
     self.server.send(buf, &extra, False)
 
+  def create_pyramid(self, VisionStreamType tp, int levels, size_t num_buffers):
+    self.server.create_pyramid(tp, levels, num_buffers)
+
   def start_listener(self):
     self.server.start_listener()
 
@@ -0,0 +1,161 @@
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "visionipc/visionipc_recorder.h"
+#include "logger/logger.h"
+
+#define ALIGN(x, align) (((x) + (align)-1) & ~((align)-1))
+
+VisionIpcRecorder::VisionIpcRecorder(std::string path, const VisionBuf *buf) {
+  f = fopen(path.c_str(), "wb");
+  assert(f != nullptr);
+
+  header.magic = VISIONIPC_RECORD_MAGIC;
+  header.type = buf->type;
+  header.rgb = buf->rgb;
+  header.width = buf->width;
+  header.height = buf->height;
+  header.stride = buf->stride;
+  header.len = buf->len;
+  header.record_size = ALIGN(VISIONIPC_RECORD_FRAME_SIZE + buf->len, VISIONIPC_RECORD_ALIGN);
+
+  padding.resize(VISIONIPC_RECORD_ALIGN, 0);
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(padding.data(), VISIONIPC_RECORD_ALIGN - sizeof(header), 1, f);
+}
+
+VisionIpcRecorder::~VisionIpcRecorder() {
+  close();
+}
+
+void VisionIpcRecorder::write(const VisionBuf *buf, const VisionIpcBufExtra &extra) {
+  assert(f != nullptr);
+  assert(buf->len == header.len);
+
+  char frame[VISIONIPC_RECORD_FRAME_SIZE] = {};
+  VisionIpcRecordFrame *record = (VisionIpcRecordFrame *)frame;
+  record->extra = extra;
+  record->frame_id = *buf->frame_id;
+
+  index.push_back(VISIONIPC_RECORD_ALIGN + index.size() * header.record_size);
+  fwrite(frame, sizeof(frame), 1, f);
+  fwrite(buf->addr, buf->len, 1, f);
+  fwrite(padding.data(), header.record_size - VISIONIPC_RECORD_FRAME_SIZE - buf->len, 1, f);
+}
+
+void VisionIpcRecorder::close() {
+  if (f == nullptr) return;
+
+  VisionIpcRecordFooter footer = {};
+  footer.index_offset = VISIONIPC_RECORD_ALIGN + index.size() * header.record_size;
+  footer.num_frames = index.size();
+  footer.magic = VISIONIPC_RECORD_MAGIC;
+  fwrite(index.data(), sizeof(uint64_t), index.size(), f);
+  fwrite(&footer, sizeof(footer), 1, f);
+
+  fclose(f);
+  f = nullptr;
+}
+
+
+VisionIpcRecording::VisionIpcRecording(std::string path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  assert(fd >= 0);
+
+  struct stat st;
+  int err = fstat(fd, &st);
+  assert(err == 0);
+  mem_len = st.st_size;
+  assert(mem_len >= VISIONIPC_RECORD_ALIGN);
+
+  mem = mmap(NULL, mem_len, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  assert(mem != MAP_FAILED);
+
+  memcpy(&header, mem, sizeof(header));
+  assert(header.magic == VISIONIPC_RECORD_MAGIC);
+  assert(header.type < VISION_STREAM_MAX);
+  // Every record has to hold the frame header and data
+  assert(header.len <= mem_len && header.record_size >= VISIONIPC_RECORD_FRAME_SIZE + header.len);
+
+  VisionIpcRecordFooter footer = {};
+  if (mem_len >= VISIONIPC_RECORD_ALIGN + sizeof(footer)) {
+    memcpy(&footer, (char *)mem + mem_len - sizeof(footer), sizeof(footer));
+  }
+
+  size_t index_end = mem_len - sizeof(footer);
+  if (footer.magic == VISIONIPC_RECORD_MAGIC && footer.index_offset <= index_end &&
+      (index_end - footer.index_offset) % sizeof(uint64_t) == 0 &&
+      footer.num_frames == (index_end - footer.index_offset) / sizeof(uint64_t)) {
+    // Records have to be aligned and end before the index
+    for (size_t i = 0; i < footer.num_frames; i++) {
+      uint64_t offset;
+      memcpy(&offset, (char *)mem + footer.index_offset + i * sizeof(uint64_t), sizeof(offset));
+      if (offset < VISIONIPC_RECORD_ALIGN || offset % alignof(VisionIpcRecordFrame) != 0 || offset > footer.index_offset ||
+          footer.index_offset - offset < VISIONIPC_RECORD_FRAME_SIZE + header.len) {
+        LOGE("recording %s has an invalid offset for frame %zu, truncating", path.c_str(), i);
+        break;
+      }
+      index.push_back(offset);
+    }
+  } else {
+    size_t num_frames = (mem_len - VISIONIPC_RECORD_ALIGN) / header.record_size;
+    LOGW("recording %s has no index, found %zu frames", path.c_str(), num_frames);
+    for (size_t i = 0; i < num_frames; i++) {
+      index.push_back(VISIONIPC_RECORD_ALIGN + i * header.record_size);
+    }
+  }
+
+  madvise(mem, mem_len, MADV_SEQUENTIAL);
+}
+
+VisionIpcRecording::~VisionIpcRecording() {
+  munmap(mem, mem_len);
+}
+
+
+VisionIpcPlayer::VisionIpcPlayer(std::string name, const std::vector<std::string> &paths, size_t num_buffers) : server(name) {
+  for (auto &path : paths) {
+    auto r = std::make_unique<VisionIpcRecording>(path);
+    VisionStreamType type = (VisionStreamType)r->header.type;
+    server.create_buffers(type, num_buffers, r->header.rgb, r->header.width, r->header.height);
+    assert(server.get_buffer(type)->len == r->header.len);
+    recordings.push_back(std::move(r));
+  }
+  server.start_listener();
+}
+
+size_t VisionIpcPlayer::size() {
+  size_t n = recordings.empty() ? 0 : SIZE_MAX;
+  for (auto &r : recordings) n = std::min(n, r->size());
+  return n;
+}
+
+uint64_t VisionIpcPlayer::timestamp(size_t i) {
+  return recordings[0]->frame(i)->extra.timestamp_eof;
+}
+
+void VisionIpcPlayer::send(size_t i) {
+  for (auto &r : recordings) {
+    const VisionIpcRecordFrame *frame = r->frame(i);
+    VisionBuf *buf = server.get_buffer((VisionStreamType)r->header.type);
+    memcpy(buf->addr, r->data(i), r->header.len);
+    buf->set_frame_id(frame->frame_id);
+
+    VisionIpcBufExtra extra = frame->extra;
+    server.send(buf, &extra, false);
+  }
+}
+
+bool VisionIpcPlayer::wait_clients(int timeout_ms) {
+  for (auto &r : recordings) {
+    if (!server.wait_clients_updated((VisionStreamType)r->header.type, timeout_ms)) return false;
+  }
+  return true;
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdio>
+
+#include "visionipc/visionipc.h"
+#include "visionipc/visionbuf.h"
+#include "visionipc/visionipc_server.h"
+
+// Raw frames of one stream on disk, laid out to be served straight from an mmap:
+//   header, padded to VISIONIPC_RECORD_ALIGN
+//   records of record_size bytes: VisionIpcRecordFrame, frame data (len bytes), padding
+//   index: one uint64_t record offset per frame, followed by VisionIpcRecordFooter
+// Without a footer (recorder killed) the frames are found from the file size.
+#define VISIONIPC_RECORD_MAGIC 0x3143455243504956ULL  // "VIPCREC1"
+#define VISIONIPC_RECORD_ALIGN 4096
+#define VISIONIPC_RECORD_FRAME_SIZE 64
+
+struct VisionIpcRecordHeader {
+  uint64_t magic;
+  uint32_t type;
+  uint32_t rgb;
+  uint64_t width;
+  uint64_t height;
+  uint64_t stride;
+  uint64_t len;
+  uint64_t record_size;
+};
+
+struct VisionIpcRecordFrame {
+  VisionIpcBufExtra extra;
+  uint64_t frame_id;  // VisionBuf frame id
+};
+static_assert(sizeof(VisionIpcRecordFrame) <= VISIONIPC_RECORD_FRAME_SIZE);
+
+struct VisionIpcRecordFooter {
+  uint64_t index_offset;
+  uint64_t num_frames;
+  uint64_t magic;
+};
+
+class VisionIpcRecorder {
+private:
+  FILE *f = nullptr;
+  VisionIpcRecordHeader header = {};
+  std::vector<uint64_t> index;
+  std::vector<char> padding;
+
+public:
+  VisionIpcRecorder(std::string path, const VisionBuf *buf);
+  ~VisionIpcRecorder();
+  void write(const VisionBuf *buf, const VisionIpcBufExtra &extra);
+  // Writes the index, called by the destructor
+  void close();
+  size_t size() { return index.size(); }
+};
+
+class VisionIpcRecording {
+private:
+  void *mem = nullptr;
+  size_t mem_len = 0;
+  std::vector<uint64_t> index;
+
+public:
+  VisionIpcRecordHeader header = {};
+
+  VisionIpcRecording(std::string path);
+  ~VisionIpcRecording();
+  size_t size() { return index.size(); }
+  const VisionIpcRecordFrame *frame(size_t i) { return (const VisionIpcRecordFrame *)((char *)mem + index[i]); }
+  const uint8_t *data(size_t i) { return (const uint8_t *)frame(i) + VISIONIPC_RECORD_FRAME_SIZE; }
+};
+
+// Serves recordings through a VisionIpcServer, frame i of every recording together
+class VisionIpcPlayer {
+private:
+  std::vector<std::unique_ptr<VisionIpcRecording>> recordings;
+
+public:
+  VisionIpcServer server;
+
+  VisionIpcPlayer(std::string name, const std::vector<std::string> &paths, size_t num_buffers=4);
+  size_t size();
+  // Timestamp of frame i, used for pacing
+  uint64_t timestamp(size_t i);
+  void send(size_t i);
+  // Lock-step, blocks until all clients received the last frames. Returns false on timeout.
+  bool wait_clients(int timeout_ms = -1);
+};
@@ -2,6 +2,7 @@
 #include <chrono>
 #include <cassert>
 #include <random>
+#include <ctime>
 
 #include <poll.h>
 #include <sys/socket.h>
@@ -51,6 +52,7 @@ void VisionIpcServer::create_buffers(VisionStreamType type, size_t num_buffers,
     buf->allocate(size);
     buf->idx = i;
     buf->type = type;
+    buf->track_dirty = track_dirty;
 
     if (device_id) buf->init_cl(device_id, ctx);
 
@@ -60,12 +62,35 @@ void VisionIpcServer::create_buffers(VisionStreamType type, size_t num_buffers,
   }
 
   cur_idx[type] = 0;
+  lease_skips[type] = 0;
+  lease_overwrites[type] = 0;
+  has_clients[type] = false;
 
   // Create msgq publisher for each of the `name` + type combos
   // TODO: compute port number directly if using zmq
   sockets[type] = PubSocket::create(msg_ctx, get_endpoint_name(name, type), false);
 }
 
+void VisionIpcServer::create_pyramid(VisionStreamType type, int levels, size_t num_buffers){
+  assert(buffers.count(type) && !buffers[type][0]->rgb);
+  assert(levels >= 1 && levels <= VISIONBUF_PYRAMID_LEVELS);
+
+  size_t width = buffers[type][0]->width, height = buffers[type][0]->height;
+  for (int level = 1; level <= levels; level++){
+    width /= 2;
+    height /= 2;
+    VisionStreamType level_type = visionbuf_pyramid_type(type, level);
+    create_buffers(level_type, num_buffers, false, width, height);
+    pyramid_last[level_type] = nullptr;
+  }
+  pyramid_levels[type] = levels;
+}
+
+VisionBuf * VisionIpcServer::get_pyramid_buffer(VisionStreamType type, int level){
+  auto it = pyramid_last.find(visionbuf_pyramid_type(type, level));
+  return it == pyramid_last.end() ? nullptr : it->second;
+}
+
 
 void VisionIpcServer::start_listener(){
   listener_thread = std::thread(&VisionIpcServer::listener, this);
@@ -75,7 +100,7 @@ void VisionIpcServer::start_listener(){
 void VisionIpcServer::listener(){
   std::cout << "Starting listener for: " << name << std::endl;
 
-  std::string path = "/tmp/visionipc_" + name;
+  std::string path = get_ipc_path(name);
   int sock = ipc_bind(path.c_str());
   assert(sock >= 0);
 
@@ -109,6 +134,7 @@ void VisionIpcServer::listener(){
       close(fd);
       continue;
     }
+    has_clients[type] = true;
 
     int fds[VISIONIPC_MAX_FDS];
     int num_fds = buffers[type].size();
@@ -138,10 +164,29 @@ void VisionIpcServer::listener(){
 
 
 VisionBuf * VisionIpcServer::get_buffer(VisionStreamType type){
-  // Do we want to keep track if the buffer has been sent out yet and warn user?
   assert(buffers.count(type));
-  auto b = buffers[type];
-  return b[cur_idx[type]++ % b.size()];
+  auto &b = buffers[type];
+
+  // Round robin, skipping buffers that a client is still reading
+  size_t idx = cur_idx[type]++;
+  for (size_t i = 0; i < b.size(); i++){
+    VisionBuf *buf = b[(idx + i) % b.size()];
+    if (!buf->is_leased()){
+      cur_idx[type] += i;
+      buf->lease->generation++;
+      return buf;
+    }
+    lease_skips[type]++;
+  }
+
+  // All buffers are leased, overwriting one tears the frame a client is reading
+  uint64_t overwrites = ++lease_overwrites[type];
+  if (overwrites == 1 || overwrites % 100 == 0){
+    LOGW("%s stream %d: all %zu buffers leased, overwrote a leased buffer %lu times", name.c_str(), type, b.size(), overwrites);
+  }
+  VisionBuf *buf = b[idx % b.size()];
+  buf->lease->generation++;
+  return buf;
 }
 
 void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync){
@@ -157,9 +202,35 @@ void VisionIpcServer::send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync
   VisionIpcPacket packet = {0};
   packet.server_id = server_id;
   packet.idx = buf->idx;
+  packet.generation = buf->lease->generation;
   packet.extra = *extra;
 
+  // Stamp with the same clock as logMonoTime so the transport hop shows up in latency traces
+  struct timespec t;
+  clock_gettime(CLOCK_BOOTTIME, &t);
+  packet.extra.timestamp_sent = t.tv_sec * 1000000000ULL + t.tv_nsec;
+
   sockets[buf->type]->send((char*)&packet, sizeof(packet));
+
+  // Levels are scaled from buf after it was synced from the device
+  auto levels = pyramid_levels.find(buf->type);
+  if (levels != pyramid_levels.end()){
+    for (int level = 1; level <= levels->second; level++){
+      VisionStreamType level_type = visionbuf_pyramid_type(buf->type, level);
+      if (!has_clients[level_type]) continue;
+
+      VisionBuf *dst = get_buffer(level_type);
+      visionbuf_downscale_yuv(buf, dst);
+      dst->set_frame_id(buf->get_frame_id());
+      send(dst, extra, false);
+      pyramid_last[level_type] = dst;
+    }
+  }
+}
+
+bool VisionIpcServer::wait_clients_updated(VisionStreamType type, int timeout_ms){
+  assert(sockets.count(type));
+  return sockets[type]->wait_readers_updated(timeout_ms);
 }
 
 VisionIpcServer::~VisionIpcServer(){
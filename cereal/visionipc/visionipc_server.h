@@ -25,18 +25,40 @@ class VisionIpcServer {
   std::map<VisionStreamType, std::vector<VisionBuf*> > buffers;
   std::map<VisionStreamType, std::map<VisionBuf*, size_t> > idxs;
 
+  // Buffers skipped because a client leased them, and leased buffers handed out anyway
+  std::map<VisionStreamType, std::atomic<uint64_t> > lease_skips;
+  std::map<VisionStreamType, std::atomic<uint64_t> > lease_overwrites;
+
+  // Number of downscaled levels of a stream, and the level buffers of the last frame.
+  // Levels are only scaled once a client connected to them.
+  std::map<VisionStreamType, int> pyramid_levels;
+  std::map<VisionStreamType, std::atomic<bool> > has_clients;
+  std::map<VisionStreamType, VisionBuf*> pyramid_last;
+
   Context * msg_ctx;
   std::map<VisionStreamType, PubSocket*> sockets;
 
   void listener(void);
 
  public:
+  // Buffers created after this is set only sync in send() when marked with
+  // buf->set_dirty(VISIONBUF_SYNC_FROM_DEVICE), i.e. after the device wrote them
+  bool track_dirty = false;
+
   VisionIpcServer(std::string name, cl_device_id device_id=nullptr, cl_context ctx=nullptr);
   ~VisionIpcServer();
 
   VisionBuf * get_buffer(VisionStreamType type);
+  uint64_t get_lease_skips(VisionStreamType type) { return lease_skips[type]; }
+  uint64_t get_lease_overwrites(VisionStreamType type) { return lease_overwrites[type]; }
 
   void create_buffers(VisionStreamType type, size_t num_buffers, bool rgb, size_t width, size_t height);
+  // Publish half (and quarter) resolution copies of a YUV stream, scaled in send() for levels with clients
+  void create_pyramid(VisionStreamType type, int levels, size_t num_buffers);
+  // Level buffer made from the last frame sent on type, nullptr until a client of the level received one
+  VisionBuf * get_pyramid_buffer(VisionStreamType type, int level);
   void send(VisionBuf * buf, VisionIpcBufExtra * extra, bool sync=true);
+  // Blocks until every client of the stream received all frames sent, msgq only
+  bool wait_clients_updated(VisionStreamType type, int timeout_ms=-1);
   void start_listener();
 };
@@ -1,9 +1,12 @@
+#include <cstring>
 #include <thread>
 #include <chrono>
+#include <unistd.h>
 
 #include "catch2/catch.hpp"
 #include "visionipc_server.h"
 #include "visionipc_client.h"
+#include "visionipc_recorder.h"
 
 static void zmq_sleep(int milliseconds=1000){
   if (messaging_use_zmq()){
@@ -135,3 +138,369 @@ TEST_CASE("Test conflate"){
   recv_buf = client.recv(&extra_recv);
   REQUIRE(recv_buf == nullptr);
 }
+
+TEST_CASE("Leased buffers are skipped"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  VisionIpcBufExtra extra = {0};
+  server.send(buf, &extra);
+  VisionBuf * recv_buf = client.recv();
+  REQUIRE(recv_buf != nullptr);
+
+  // The client holds buf until its next recv, so the server keeps using the other one
+  VisionBuf * other = server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE(other != buf);
+  REQUIRE(server.get_buffer(VISION_STREAM_YUV_BACK) == other);
+  REQUIRE(server.get_lease_skips(VISION_STREAM_YUV_BACK) == 1);
+  REQUIRE(server.get_lease_overwrites(VISION_STREAM_YUV_BACK) == 0);
+
+  client.release();
+  REQUIRE(server.get_buffer(VISION_STREAM_YUV_BACK) == buf);
+}
+
+TEST_CASE("Leased buffer is overwritten when all are leased"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  VisionIpcBufExtra extra = {0};
+  server.send(buf, &extra);
+  REQUIRE(client.recv() != nullptr);
+
+  REQUIRE(server.get_buffer(VISION_STREAM_YUV_BACK) == buf);
+  REQUIRE(server.get_lease_overwrites(VISION_STREAM_YUV_BACK) == 1);
+}
+
+TEST_CASE("Frames reused before recv are dropped"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  // Both frames are queued, the second one reused the only buffer
+  VisionIpcBufExtra extra = {0};
+  for (uint32_t frame_id : {1, 2}) {
+    extra.frame_id = frame_id;
+    server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  }
+
+  VisionIpcBufExtra recv_extra;
+  VisionBuf *buf = client.recv(&recv_extra);
+  REQUIRE(buf != nullptr);
+  REQUIRE(recv_extra.frame_id == 2);
+  REQUIRE(client.overwritten == 1);
+}
+
+TEST_CASE("Synchronized streams"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_WIDE, 4, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcSyncClient client("camerad", {VISION_STREAM_YUV_BACK, VISION_STREAM_YUV_WIDE}, 0, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  auto send = [&](VisionStreamType type, uint32_t frame_id) {
+    VisionBuf * buf = server.get_buffer(type);
+    VisionIpcBufExtra extra = {0};
+    extra.frame_id = frame_id;
+    server.send(buf, &extra);
+  };
+  send(VISION_STREAM_YUV_BACK, 1);
+  send(VISION_STREAM_YUV_BACK, 2);
+  send(VISION_STREAM_YUV_WIDE, 2);
+  send(VISION_STREAM_YUV_BACK, 3);
+  send(VISION_STREAM_YUV_WIDE, 3);
+
+  std::vector<VisionBuf*> bufs;
+  std::vector<VisionIpcBufExtra> extras;
+  REQUIRE(client.recv(bufs, &extras));
+  REQUIRE(bufs.size() == 2);
+  REQUIRE(bufs[0]->type == VISION_STREAM_YUV_BACK);
+  REQUIRE(bufs[1]->type == VISION_STREAM_YUV_WIDE);
+  REQUIRE(extras[0].frame_id == 2);
+  REQUIRE(extras[1].frame_id == 2);
+  REQUIRE(client.dropped[0] == 1);
+  REQUIRE(client.dropped[1] == 0);
+
+  REQUIRE(client.recv(bufs, &extras));
+  REQUIRE(extras[0].frame_id == 3);
+  REQUIRE(extras[1].frame_id == 3);
+
+  REQUIRE_FALSE(client.recv(bufs, &extras, 10));
+}
+
+TEST_CASE("Synchronized streams with skew"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_WIDE, 4, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcSyncClient client("camerad", {VISION_STREAM_YUV_BACK, VISION_STREAM_YUV_WIDE}, 1);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = 10;
+  server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  extra.frame_id = 11;
+  server.send(server.get_buffer(VISION_STREAM_YUV_WIDE), &extra);
+
+  std::vector<VisionBuf*> bufs;
+  std::vector<VisionIpcBufExtra> extras;
+  // Only paired once no closer frame arrived within the timeout
+  REQUIRE(client.recv(bufs, &extras, 10));
+  REQUIRE(extras[0].frame_id == 10);
+  REQUIRE(extras[1].frame_id == 11);
+
+  SECTION("a later frame ends the wait for a closer one"){
+    extra.frame_id = 12;
+    server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+    extra.frame_id = 13;
+    server.send(server.get_buffer(VISION_STREAM_YUV_WIDE), &extra);
+    extra.frame_id = 14;
+    server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+
+    REQUIRE(client.recv(bufs, &extras, 0));
+    REQUIRE(extras[0].frame_id == 12);
+    REQUIRE(extras[1].frame_id == 13);
+  }
+}
+
+TEST_CASE("Synchronized streams prefer exact matches"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_WIDE, 4, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcSyncClient client("camerad", {VISION_STREAM_YUV_BACK, VISION_STREAM_YUV_WIDE}, 1);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = 10;
+  server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  extra.frame_id = 11;
+  server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  server.send(server.get_buffer(VISION_STREAM_YUV_WIDE), &extra);
+
+  std::vector<VisionBuf*> bufs;
+  std::vector<VisionIpcBufExtra> extras;
+  REQUIRE(client.recv(bufs, &extras));
+  REQUIRE(extras[0].frame_id == 11);
+  REQUIRE(extras[1].frame_id == 11);
+  REQUIRE(client.dropped[0] == 1);
+}
+
+TEST_CASE("Synchronized streams never exceed max_skew"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 4, false, 100, 100);
+  server.create_buffers(VISION_STREAM_YUV_WIDE, 8, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcSyncClient client("camerad", {VISION_STREAM_YUV_BACK, VISION_STREAM_YUV_WIDE}, 0);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = 10;
+  server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  for (uint32_t frame_id : {5, 12, 13}) {
+    extra.frame_id = frame_id;
+    server.send(server.get_buffer(VISION_STREAM_YUV_WIDE), &extra);
+  }
+
+  // Dropping 5 moves the wide front past 10, which has no match left
+  std::vector<VisionBuf*> bufs;
+  std::vector<VisionIpcBufExtra> extras;
+  REQUIRE_FALSE(client.recv(bufs, &extras, 10));
+
+  extra.frame_id = 12;
+  server.send(server.get_buffer(VISION_STREAM_YUV_BACK), &extra);
+  REQUIRE(client.recv(bufs, &extras));
+  REQUIRE(extras[0].frame_id == 12);
+  REQUIRE(extras[1].frame_id == 12);
+}
+
+TEST_CASE("Dirty tracking"){
+  VisionIpcServer server("camerad");
+  server.track_dirty = true;
+  server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 100, 100);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+  client.track_dirty = true;
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  VisionBuf * buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  REQUIRE_FALSE(buf->needs_sync(VISIONBUF_SYNC_FROM_DEVICE));
+  buf->set_dirty(VISIONBUF_SYNC_FROM_DEVICE);
+  REQUIRE(buf->is_dirty(VISIONBUF_SYNC_FROM_DEVICE));
+
+  VisionIpcBufExtra extra = {0};
+  server.send(buf, &extra);
+  REQUIRE_FALSE(buf->is_dirty(VISIONBUF_SYNC_FROM_DEVICE));
+
+  VisionBuf * recv_buf = client.recv();
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(recv_buf->is_dirty(VISIONBUF_SYNC_TO_DEVICE));
+  REQUIRE(recv_buf->sync(VISIONBUF_SYNC_TO_DEVICE) == 0);
+  REQUIRE_FALSE(recv_buf->is_dirty(VISIONBUF_SYNC_TO_DEVICE));
+}
+
+TEST_CASE("Buffers are sealed"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 100, 100);
+  server.start_listener();
+  for (int i = 0; i < 2; i++) {
+    VisionBuf *buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+    REQUIRE(buf->mmap_len >= buf->len);
+#ifdef __linux__
+    REQUIRE(ftruncate(buf->fd, buf->mmap_len * 2) != 0);
+#endif
+  }
+}
+
+TEST_CASE("Pyramid streams"){
+  VisionIpcServer server("camerad");
+  server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 16, 8);
+  server.create_pyramid(VISION_STREAM_YUV_BACK, 2, 2);
+  server.start_listener();
+
+  VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK_QUARTER, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+  REQUIRE(client.buffers[0].width == 4);
+  REQUIRE(client.buffers[0].height == 2);
+
+  VisionBuf *buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+  for (size_t i = 0; i < buf->width * buf->height; i++) buf->y[i] = (i % buf->width) < 8 ? 10 : 30;
+  memset(buf->u, 100, buf->width / 2 * buf->height / 2);
+  memset(buf->v, 200, buf->width / 2 * buf->height / 2);
+  buf->set_frame_id(42);
+
+  VisionIpcBufExtra extra = {0};
+  extra.frame_id = 42;
+  server.send(buf, &extra);
+
+  VisionIpcBufExtra recv_extra;
+  VisionBuf * recv_buf = client.recv(&recv_extra);
+  REQUIRE(recv_buf != nullptr);
+  REQUIRE(recv_extra.frame_id == 42);
+  REQUIRE(recv_buf->get_frame_id() == 42);
+  REQUIRE(recv_buf->y[0] == 10);
+  REQUIRE(recv_buf->y[3] == 30);
+  REQUIRE(recv_buf->u[0] == 100);
+  REQUIRE(recv_buf->v[0] == 200);
+  REQUIRE(server.get_pyramid_buffer(VISION_STREAM_YUV_BACK, 2)->addr != nullptr);
+  // Nobody connected to the half level, so it isn't scaled
+  REQUIRE(server.get_pyramid_buffer(VISION_STREAM_YUV_BACK, 1) == nullptr);
+}
+
+TEST_CASE("Record and replay"){
+  std::string path = "/tmp/visionipc_test_recording";
+  {
+    VisionIpcServer server("camerad");
+    server.create_buffers(VISION_STREAM_YUV_BACK, 2, false, 16, 8);
+    server.start_listener();
+
+    VisionIpcClient client = VisionIpcClient("camerad", VISION_STREAM_YUV_BACK, false);
+    REQUIRE(client.connect());
+    zmq_sleep();
+
+    VisionIpcRecorder recorder(path, &client.buffers[0]);
+    for (uint32_t i = 0; i < 3; i++) {
+      VisionBuf *buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+      memset(buf->addr, i + 1, buf->len);
+      buf->set_frame_id(100 + i);
+      VisionIpcBufExtra extra = {0};
+      extra.frame_id = 100 + i;
+      extra.timestamp_eof = 1000 * i;
+      server.send(buf, &extra);
+
+      VisionIpcBufExtra recv_extra;
+      VisionBuf *recv_buf = client.recv(&recv_extra);
+      REQUIRE(recv_buf != nullptr);
+      recorder.write(recv_buf, recv_extra);
+    }
+  }
+
+  VisionIpcRecording recording(path);
+  REQUIRE(recording.size() == 3);
+  REQUIRE(recording.frame(2)->extra.frame_id == 102);
+  REQUIRE(recording.data(2)[0] == 3);
+
+  VisionIpcPlayer player("replay", {path});
+  REQUIRE(player.size() == 3);
+  REQUIRE(player.timestamp(1) == 1000);
+
+  VisionIpcClient client = VisionIpcClient("replay", VISION_STREAM_YUV_BACK, false);
+  REQUIRE(client.connect());
+  zmq_sleep();
+
+  for (size_t i = 0; i < 3; i++) {
+    player.send(i);
+    VisionIpcBufExtra extra;
+    VisionBuf *buf = client.recv(&extra);
+    REQUIRE(buf != nullptr);
+    REQUIRE(extra.frame_id == 100 + i);
+    REQUIRE(buf->get_frame_id() == 100 + i);
+    REQUIRE(((uint8_t*)buf->addr)[buf->len - 1] == i + 1);
+    if (!messaging_use_zmq()) {
+      REQUIRE(player.wait_clients(100));
+    }
+  }
+  unlink(path.c_str());
+}
+
+TEST_CASE("Recording with a corrupt index is truncated"){
+  std::string path = "/tmp/visionipc_test_recording_corrupt";
+  {
+    VisionIpcServer server("camerad");
+    server.create_buffers(VISION_STREAM_YUV_BACK, 1, false, 16, 8);
+    server.start_listener();
+    VisionBuf *buf = server.get_buffer(VISION_STREAM_YUV_BACK);
+
+    VisionIpcRecorder recorder(path, buf);
+    for (uint32_t i = 0; i < 3; i++) {
+      VisionIpcBufExtra extra = {0};
+      extra.frame_id = i;
+      buf->set_frame_id(i);
+      recorder.write(buf, extra);
+    }
+  }
+
+  // Point the second frame past the end of the file
+  VisionIpcRecordFooter footer;
+  FILE *f = fopen(path.c_str(), "r+b");
+  REQUIRE(f != nullptr);
+  fseek(f, -(long)sizeof(footer), SEEK_END);
+  REQUIRE(fread(&footer, sizeof(footer), 1, f) == 1);
+  REQUIRE(footer.num_frames == 3);
+  uint64_t offset = UINT64_MAX & ~0xfffULL;
+  fseek(f, footer.index_offset + sizeof(uint64_t), SEEK_SET);
+  fwrite(&offset, sizeof(offset), 1, f);
+  fclose(f);
+
+  VisionIpcRecording recording(path);
+  REQUIRE(recording.size() == 1);
+  REQUIRE(recording.frame(0)->frame_id == 0);
+  unlink(path.c_str());
+}
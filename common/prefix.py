@@ -0,0 +1,46 @@
+import os
+import shutil
+import uuid
+from typing import Optional
+
+PREFIX_ENV = "OPENPILOT_PREFIX"
+
+
+class OpenpilotPrefix:
+  """
+  Isolates the msgq queues, sim clock and VisionIPC sockets of everything started
+  inside the context, so several stacks can run on one host. Child processes
+  inherit the prefix through the environment.
+  with OpenpilotPrefix():
+    run_replay()
+  """
+  def __init__(self, prefix: Optional[str] = None, clean_dirs_on_exit: bool = True):
+    self.prefix = prefix if prefix is not None else uuid.uuid4().hex[:15]
+    self.msgq_path = os.path.join("/dev/shm", self.prefix)
+    self.clean_dirs_on_exit = clean_dirs_on_exit
+
+  def __enter__(self):
+    self.prev_prefix = os.environ.get(PREFIX_ENV)
+    os.environ[PREFIX_ENV] = self.prefix
+    os.makedirs(self.msgq_path, exist_ok=True)
+    return self
+
+  def __exit__(self, exc_type, exc_val, exc_tb):
+    if self.clean_dirs_on_exit:
+      self.clean_dirs()
+
+    if self.prev_prefix is None:
+      del os.environ[PREFIX_ENV]
+    else:
+      os.environ[PREFIX_ENV] = self.prev_prefix
+    return False
+
+  def clean_dirs(self):
+    shutil.rmtree(self.msgq_path, ignore_errors=True)
+    ipc_prefix = f"{self.prefix}_visionipc_"
+    for f in os.listdir("/tmp"):
+      if f.startswith(ipc_prefix):
+        try:
+          os.remove(os.path.join("/tmp", f))
+        except OSError:
+          pass
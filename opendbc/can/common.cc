@@ -217,3 +217,65 @@ uint64_t read_u64_le(const uint8_t* v) {
           | ((uint64_t)v[6] << 48)
           | ((uint64_t)v[7] << 56));
 }
+
+// A signal of up to 64 bits spans at most 9 bytes. For little endian signals b1 is the
+// index of the lsb, for big endian ones b1 counts from the msb of byte 0.
+static unsigned __int128 read_window(const uint8_t *dat, const Signal &sig, int first, int last) {
+  unsigned __int128 v = 0;
+  if (sig.is_little_endian) {
+    for (int i = last; i >= first; i--) v = (v << 8) | dat[i];
+  } else {
+    for (int i = first; i <= last; i++) v = (v << 8) | dat[i];
+  }
+  return v;
+}
+
+static int window_shift(const Signal &sig, int first, int last) {
+  return sig.is_little_endian ? sig.b1 % 8 : (last + 1) * 8 - (sig.b1 + sig.b2);
+}
+
+static uint64_t signal_mask(const Signal &sig) {
+  return sig.b2 >= 64 ? ~0ULL : ((1ULL << sig.b2) - 1);
+}
+
+int64_t get_raw_value(const uint8_t *dat, const Signal &sig) {
+  int first = sig.b1 / 8, last = (sig.b1 + sig.b2 - 1) / 8;
+  return (uint64_t)(read_window(dat, sig, first, last) >> window_shift(sig, first, last)) & signal_mask(sig);
+}
+
+bool is_checksum(const Signal &sig) {
+  switch (sig.type) {
+    case SignalType::HONDA_CHECKSUM:
+    case SignalType::TOYOTA_CHECKSUM:
+    case SignalType::PEDAL_CHECKSUM:
+    case SignalType::VOLKSWAGEN_CHECKSUM:
+    case SignalType::SUBARU_CHECKSUM:
+    case SignalType::CHRYSLER_CHECKSUM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+const Signal *fd_checksum_signal(const Msg *msg) {
+  if (msg->size <= CAN_MAX_DATA) return nullptr;
+
+  for (size_t i = 0; i < msg->num_sigs; i++) {
+    if (is_checksum(msg->sigs[i])) return &msg->sigs[i];
+  }
+  return nullptr;
+}
+
+void set_raw_value(uint8_t *dat, const Signal &sig, int64_t ival) {
+  int first = sig.b1 / 8, last = (sig.b1 + sig.b2 - 1) / 8;
+  int shift = window_shift(sig, first, last);
+  unsigned __int128 mask = (unsigned __int128)signal_mask(sig) << shift;
+  unsigned __int128 v = read_window(dat, sig, first, last);
+  v = (v & ~mask) | (((unsigned __int128)((uint64_t)ival & signal_mask(sig))) << shift);
+
+  if (sig.is_little_endian) {
+    for (int i = first; i <= last; i++, v >>= 8) dat[i] = v & 0xFF;
+  } else {
+    for (int i = last; i >= first; i--, v >>= 8) dat[i] = v & 0xFF;
+  }
+}
@@ -24,6 +24,12 @@ unsigned int volkswagen_crc(unsigned int address, uint64_t d, int l);
 unsigned int pedal_checksum(uint64_t d, int l);
 uint64_t read_u64_be(const uint8_t* v);
 uint64_t read_u64_le(const uint8_t* v);
+// Signal access anywhere in a CAN FD frame, classic frames use the uint64_t fast path
+int64_t get_raw_value(const uint8_t *dat, const Signal &sig);
+void set_raw_value(uint8_t *dat, const Signal &sig, int64_t ival);
+bool is_checksum(const Signal &sig);
+// The checksums are only defined over classic frames, returns the offending signal of a CAN FD message
+const Signal *fd_checksum_signal(const Msg *msg);
 
 class MessageState {
 public:
@@ -78,8 +84,12 @@ private:
   std::map<std::pair<uint32_t, std::string>, Signal> signal_lookup;
   std::map<uint32_t, Msg> message_lookup;
 
+  uint64_t pack_classic(uint32_t address, const std::vector<SignalPackValue> &values, int counter);
+  void pack_fd(uint32_t address, const std::vector<SignalPackValue> &values, int counter, uint8_t *dat);
+
 public:
   CANPacker(const std::string& dbc_name);
-  uint64_t pack(uint32_t address, const std::vector<SignalPackValue> &values, int counter);
+  // Message data, as many bytes as the DBC size of the message
+  std::vector<uint8_t> pack(uint32_t address, const std::vector<SignalPackValue> &values, int counter);
   Msg* lookup_message(uint32_t address);
 };
@@ -6,6 +6,8 @@
 #include <vector>
 
 #define ARRAYSIZE(x) (sizeof(x)/sizeof(x[0]))
+#define CAN_MAX_DATA 8
+#define CANFD_MAX_DATA 64
 
 struct SignalPackValue {
   std::string name;
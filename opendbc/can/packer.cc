@@ -39,6 +39,11 @@ CANPacker::CANPacker(const std::string& dbc_name) {
 
   for (int i=0; i<dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
+    if (const Signal *sig = fd_checksum_signal(msg)) {
+      fprintf(stderr, "CANPacker: CAN FD message 0x%X in DBC %s has checksum %s, only classic frames are supported\n",
+              msg->address, dbc_name.c_str(), sig->name);
+      assert(false);
+    }
     message_lookup[msg->address] = *msg;
     for (int j=0; j<msg->num_sigs; j++) {
       const Signal* sig = &msg->sigs[j];
@@ -48,7 +53,7 @@ CANPacker::CANPacker(const std::string& dbc_name) {
   init_crc_lookup_tables();
 }
 
-uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
+uint64_t CANPacker::pack_classic(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
   uint64_t ret = 0;
   for (const auto& sigval : signals) {
     double value = sigval.value;
@@ -112,6 +117,46 @@ uint64_t CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &s
   return ret;
 }
 
+// CAN FD messages with checksums are refused in the constructor, only the signals and the counter are set
+void CANPacker::pack_fd(uint32_t address, const std::vector<SignalPackValue> &signals, int counter, uint8_t *dat) {
+  for (const auto& sigval : signals) {
+    auto sig_it = signal_lookup.find(std::make_pair(address, sigval.name));
+    if (sig_it == signal_lookup.end()) {
+      WARN("undefined signal %s - %d\n", sigval.name.c_str(), address);
+      continue;
+    }
+    const auto& sig = sig_it->second;
+
+    int64_t ival = (int64_t)(round((sigval.value - sig.offset) / sig.factor));
+    set_raw_value(dat, sig, ival);
+  }
+
+  if (counter >= 0) {
+    auto sig_it = signal_lookup.find(std::make_pair(address, "COUNTER"));
+    if (sig_it == signal_lookup.end()) {
+      WARN("COUNTER not defined\n");
+      return;
+    }
+    set_raw_value(dat, sig_it->second, counter);
+  }
+}
+
+std::vector<uint8_t> CANPacker::pack(uint32_t address, const std::vector<SignalPackValue> &signals, int counter) {
+  auto msg_it = message_lookup.find(address);
+  size_t size = msg_it == message_lookup.end() ? CAN_MAX_DATA : msg_it->second.size;
+  std::vector<uint8_t> ret(size, 0);
+
+  if (size > CAN_MAX_DATA) {
+    pack_fd(address, signals, counter, ret.data());
+  } else {
+    uint64_t dat = pack_classic(address, signals, counter);
+    for (size_t i = 0; i < size; i++) {
+      ret[i] = dat >> (56 - 8 * i);
+    }
+  }
+  return ret;
+}
+
 Msg* CANPacker::lookup_message(uint32_t address) {
   return &message_lookup[address];
 }
@@ -14,14 +14,18 @@
 #define INFO printf
 
 bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
-  uint64_t dat_le = read_u64_le(dat);
-  uint64_t dat_be = read_u64_be(dat);
+  // CAN FD messages don't fit in a uint64_t, signals are read from the bytes
+  const bool fd = size > CAN_MAX_DATA;
+  uint64_t dat_le = fd ? 0 : read_u64_le(dat);
+  uint64_t dat_be = fd ? 0 : read_u64_be(dat);
 
   for (int i=0; i < parse_sigs.size(); i++) {
     auto& sig = parse_sigs[i];
     int64_t tmp;
 
-    if (sig.is_little_endian){
+    if (fd) {
+      tmp = get_raw_value(dat, sig);
+    } else if (sig.is_little_endian){
       tmp = (dat_le >> sig.b1) & ((1ULL << sig.b2)-1);
     } else {
       tmp = (dat_be >> sig.bo) & ((1ULL << sig.b2)-1);
@@ -34,7 +38,11 @@ bool MessageState::parse(uint64_t sec, uint16_t ts_, uint8_t * dat) {
     DEBUG("parse 0x%X %s -> %lld\n", address, sig.name, tmp);
 
     if (!ignore_checksum) {
-      if (sig.type == SignalType::HONDA_CHECKSUM) {
+      // the checksums are defined over classic frames
+      if (fd && is_checksum(sig)) {
+        INFO("0x%X CHECKSUM NOT SUPPORTED ON CAN FD\n", address);
+        return false;
+      } else if (sig.type == SignalType::HONDA_CHECKSUM) {
         if (honda_checksum(address, dat_be, size) != tmp) {
           INFO("0x%X CHECKSUM FAIL\n", address);
           return false;
@@ -139,6 +147,11 @@ CANParser::CANParser(int abus, const std::string& dbc_name,
       fprintf(stderr, "CANParser: could not find message 0x%X in DBC %s\n", op.address, dbc_name.c_str());
       assert(false);
     }
+    if (const Signal *sig = fd_checksum_signal(msg)) {
+      fprintf(stderr, "CANParser: CAN FD message 0x%X in DBC %s has checksum %s, only classic frames are supported\n",
+              op.address, dbc_name.c_str(), sig->name);
+      assert(false);
+    }
 
     state.size = msg->size;
 
@@ -178,6 +191,12 @@ CANParser::CANParser(int abus, const std::string& dbc_name, bool ignore_checksum
 
   for (int i = 0; i < dbc->num_msgs; i++) {
     const Msg* msg = &dbc->msgs[i];
+    const Signal *sig = ignore_checksum ? nullptr : fd_checksum_signal(msg);
+    if (sig) {
+      fprintf(stderr, "CANParser: CAN FD message 0x%X in DBC %s has checksum %s, only classic frames are supported\n",
+              msg->address, dbc_name.c_str(), sig->name);
+      assert(false);
+    }
     MessageState state = {
       .address = msg->address,
       .size = msg->size,
@@ -234,8 +253,8 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::List<cereal::CanData>::Rea
       continue;
     }
 
-    if (cmsg.getDat().size() > 8) continue; //shouldn't ever happen
-    uint8_t dat[8] = {0};
+    if (cmsg.getDat().size() > CANFD_MAX_DATA) continue; //shouldn't ever happen
+    uint8_t dat[CANFD_MAX_DATA] = {0};
     memcpy(dat, cmsg.getDat().begin(), cmsg.getDat().size());
 
     state_it->second.parse(sec, cmsg.getBusTime(), dat);
@@ -259,8 +278,8 @@ void CANParser::UpdateCans(uint64_t sec, const capnp::DynamicStruct::Reader& cms
   }
 
   auto dat = cmsg.get("dat").as<capnp::Data>();
-  if (dat.size() > 8) return; //shouldn't ever happen
-  uint8_t data[8] = {0};
+  if (dat.size() > CANFD_MAX_DATA) return; //shouldn't ever happen
+  uint8_t data[CANFD_MAX_DATA] = {0};
   memcpy(data, dat.begin(), dat.size());
   state_it->second.parse(sec, cmsg.get("busTime").as<uint16_t>(), data);
 }
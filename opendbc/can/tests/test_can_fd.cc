@@ -0,0 +1,124 @@
+#include <cstring>
+
+#include "catch2/catch.hpp"
+#include "common.h"
+
+static const Signal classic_sigs[] = {
+  {.name="LE", .b1=0, .b2=12, .bo=52, .is_signed=false, .factor=1, .offset=0, .is_little_endian=true, .type=DEFAULT},
+  {.name="BE", .b1=16, .b2=16, .bo=32, .is_signed=true, .factor=0.5, .offset=0, .is_little_endian=false, .type=DEFAULT},
+};
+static const Signal fd_sigs[] = {
+  {.name="COUNTER", .b1=4, .b2=4, .bo=0, .is_signed=false, .factor=1, .offset=0, .is_little_endian=true, .type=HONDA_COUNTER},
+  {.name="LE_SIGNED", .b1=300, .b2=20, .bo=0, .is_signed=true, .factor=0.1, .offset=0, .is_little_endian=true, .type=DEFAULT},
+  {.name="BE_OFFSET", .b1=401, .b2=13, .bo=0, .is_signed=false, .factor=1, .offset=-100, .is_little_endian=false, .type=DEFAULT},
+  {.name="LE_LAST", .b1=448, .b2=64, .bo=0, .is_signed=false, .factor=1, .offset=0, .is_little_endian=true, .type=DEFAULT},
+  {.name="BE_64", .b1=64, .b2=64, .bo=0, .is_signed=false, .factor=1, .offset=0, .is_little_endian=false, .type=DEFAULT},
+};
+static const Signal fd_checksum_sigs[] = {
+  {.name="CHECKSUM", .b1=0, .b2=8, .bo=56, .is_signed=false, .factor=1, .offset=0, .is_little_endian=true, .type=VOLKSWAGEN_CHECKSUM},
+};
+static const Msg msgs[] = {
+  {.name="CLASSIC", .address=0x100, .size=8, .num_sigs=2, .sigs=classic_sigs},
+  {.name="FD", .address=0x200, .size=64, .num_sigs=5, .sigs=fd_sigs},
+};
+static const Msg checksum_msgs[] = {
+  {.name="FD_CHECKSUM", .address=0x300, .size=64, .num_sigs=1, .sigs=fd_checksum_sigs},
+};
+static const DBC test_dbc = {.name="test_can_fd", .num_msgs=2, .msgs=msgs, .vals=nullptr, .num_vals=0};
+dbc_init(test_dbc)
+
+static MessageState message_state(const Msg &msg) {
+  MessageState state = {.address = msg.address, .size = msg.size};
+  state.parse_sigs.assign(msg.sigs, msg.sigs + msg.num_sigs);
+  state.vals.resize(msg.num_sigs);
+  return state;
+}
+
+TEST_CASE("get_raw_value/set_raw_value round trip across the 8 byte boundary"){
+  // bits 60..67 little endian, bits 58..69 big endian (counted from the msb of byte 0)
+  const Signal le = {.name="LE", .b1=60, .b2=8, .bo=0, .is_signed=false, .factor=1, .offset=0, .is_little_endian=true, .type=DEFAULT};
+  const Signal be = {.name="BE", .b1=58, .b2=12, .bo=0, .is_signed=false, .factor=1, .offset=0, .is_little_endian=false, .type=DEFAULT};
+
+  for (const Signal &sig : {le, be}) {
+    uint8_t dat[CANFD_MAX_DATA];
+    memset(dat, 0xAA, sizeof(dat));
+    uint8_t expected[CANFD_MAX_DATA];
+    memcpy(expected, dat, sizeof(dat));
+
+    int64_t max = (1ULL << sig.b2) - 1;
+    for (int64_t v : {(int64_t)0, (int64_t)1, max / 3, max}) {
+      set_raw_value(dat, sig, v);
+      REQUIRE(get_raw_value(dat, sig) == v);
+    }
+
+    // Only bytes 7 and 8 are touched
+    set_raw_value(dat, sig, 0xAA & max);
+    for (int i = 0; i < CANFD_MAX_DATA; i++) {
+      if (i == 7 || i == 8) continue;
+      REQUIRE(dat[i] == expected[i]);
+    }
+  }
+
+  // The little endian signal starts in the high nibble of byte 7
+  uint8_t dat[CANFD_MAX_DATA] = {};
+  set_raw_value(dat, le, 0xFF);
+  REQUIRE(dat[7] == 0xF0);
+  REQUIRE(dat[8] == 0x0F);
+
+  // The big endian signal ends in the high nibble of byte 8
+  memset(dat, 0, sizeof(dat));
+  set_raw_value(dat, be, 0xFFF);
+  REQUIRE(dat[7] == 0x3F);
+  REQUIRE(dat[8] == 0xFC);
+}
+
+TEST_CASE("Classic frame pack/parse"){
+  CANPacker packer("test_can_fd");
+  auto dat = packer.pack(0x100, {{"LE", 0xABC}, {"BE", -3.5}}, -1);
+  REQUIRE(dat.size() == 8);
+  REQUIRE(dat[0] == 0xBC);
+  REQUIRE(dat[1] == 0x0A);
+  REQUIRE(dat[2] == 0xFF);
+  REQUIRE(dat[3] == 0xF9);
+
+  MessageState state = message_state(msgs[0]);
+  uint8_t buf[CANFD_MAX_DATA] = {};
+  memcpy(buf, dat.data(), dat.size());
+  REQUIRE(state.parse(1, 0, buf));
+  REQUIRE(state.vals[0] == 0xABC);
+  REQUIRE(state.vals[1] == -3.5);
+}
+
+TEST_CASE("64 byte CAN FD pack/parse"){
+  CANPacker packer("test_can_fd");
+  auto dat = packer.pack(0x200, {{"LE_SIGNED", -1234.5}, {"BE_OFFSET", 4000}, {"LE_LAST", (double)0x1234567800000000ULL}, {"BE_64", (double)0x0123456789ABCD00ULL}}, 9);
+  REQUIRE(dat.size() == 64);
+
+  MessageState state = message_state(msgs[1]);
+  state.counter = 8;
+  REQUIRE(state.parse(1, 0, dat.data()));
+  REQUIRE(state.vals[0] == 9);
+  REQUIRE(state.vals[1] == -1234.5);
+  REQUIRE(state.vals[2] == 4000);
+  REQUIRE(state.vals[3] == (double)0x1234567800000000ULL);
+  REQUIRE(state.vals[4] == (double)0x0123456789ABCD00ULL);
+
+  // Only the bytes covered by the signals are set
+  REQUIRE(dat[0] == 0x90);
+  REQUIRE(dat[8] == 0x01);
+  REQUIRE(dat[14] == 0xCD);
+  REQUIRE(dat[63] == 0x12);
+}
+
+TEST_CASE("CAN FD checksums are rejected"){
+  REQUIRE(fd_checksum_signal(&msgs[0]) == nullptr);
+  REQUIRE(fd_checksum_signal(&msgs[1]) == nullptr);
+  REQUIRE(fd_checksum_signal(&checksum_msgs[0]) == &fd_checksum_sigs[0]);
+
+  uint8_t dat[CANFD_MAX_DATA] = {};
+  MessageState state = message_state(checksum_msgs[0]);
+  REQUIRE(!state.parse(1, 0, dat));
+
+  state.ignore_checksum = true;
+  REQUIRE(state.parse(1, 0, dat));
+}
@@ -189,7 +189,6 @@ Panda *usb_connect(std::string serial="", uint32_t index=0) {
 void can_send_thread(std::vector<Panda *> pandas, bool fake_send) {
   LOGD("start send thread");
 
-  AlignedBuffer aligned_buf;
   Context * context = Context::create();
   SubSocket * subscriber = SubSocket::create(context, "sendcan");
   assert(subscriber != NULL);
@@ -202,28 +201,33 @@ void can_send_thread(std::vector<Panda *> pandas, bool fake_send) {
       break;
     }
 
-    Message * msg = subscriber->receive();
+    // Parsed in place, the frames are packed before anything goes out
+    bool send = false;
+    int r = receive_leased(subscriber, [&](cereal::Event::Reader &event) {
+      //Dont send if older than 1 second
+      send = !fake_send && nanos_since_boot() - event.getLogMonoTime() < 1e9;
+      if (send) {
+        for (const auto& panda : pandas) {
+          panda->can_pack(event.getSendcan());
+        }
+      }
+    }, false);
 
-    if (!msg) {
+    if (r == 0) {
       if (errno == EINTR) {
         do_exit = true;
       }
       continue;
+    } else if (r < 0) {
+      LOGE("sendcan overwritten while reading, dropped");
+      continue;
     }
 
-    capnp::FlatArrayMessageReader cmsg(aligned_buf.align(msg));
-    cereal::Event::Reader event = cmsg.getRoot<cereal::Event>();
-
-    //Dont send if older than 1 second
-    if (nanos_since_boot() - event.getLogMonoTime() < 1e9) {
-      if (!fake_send) {
-        for (const auto& panda : pandas) {
-          panda->can_send(event.getSendcan());
-        }
+    if (send) {
+      for (const auto& panda : pandas) {
+        panda->can_send_packed();
       }
     }
-
-    delete msg;
   }
 
   delete subscriber;
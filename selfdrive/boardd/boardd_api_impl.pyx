@@ -3,6 +3,7 @@
 from libcpp.vector cimport vector
 from libcpp.string cimport string
 from libcpp cimport bool
+from libc.stdint cimport uint32_t, uint64_t
 
 cdef struct can_frame:
   long address
@@ -10,9 +11,10 @@ cdef struct can_frame:
   long busTime
   long src
 
-cdef extern void can_list_to_can_capnp_cpp(const vector[can_frame] &can_list, string &out, bool sendCan, bool valid)
+cdef extern void can_list_to_can_capnp_cpp(const vector[can_frame] &can_list, string &out, bool sendCan, bool valid,
+                                           uint32_t trace_frame_id, uint64_t trace_timestamp_eof)
 
-def can_list_to_can_capnp(can_msgs, msgtype='can', valid=True):
+def can_list_to_can_capnp(can_msgs, msgtype='can', valid=True, trace=None):
   cdef vector[can_frame] can_list
   can_list.reserve(len(can_msgs))
 
@@ -24,5 +26,10 @@ def can_list_to_can_capnp(can_msgs, msgtype='can', valid=True):
     f.src = can_msg[3]
     can_list.push_back(f)
   cdef string out
-  can_list_to_can_capnp_cpp(can_list, out, msgtype == 'sendcan', valid)
+  cdef uint32_t trace_frame_id = 0
+  cdef uint64_t trace_timestamp_eof = 0
+  if trace is not None:
+    trace_frame_id = trace.frameId
+    trace_timestamp_eof = trace.timestampEof
+  can_list_to_can_capnp_cpp(can_list, out, msgtype == 'sendcan', valid, trace_frame_id, trace_timestamp_eof)
   return out
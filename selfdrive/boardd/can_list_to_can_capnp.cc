@@ -3,9 +3,15 @@
 
 extern "C" {
 
-void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::string &out, bool sendCan, bool valid) {
+void can_list_to_can_capnp_cpp(const std::vector<can_frame> &can_list, std::string &out, bool sendCan, bool valid,
+                               uint32_t trace_frame_id, uint64_t trace_timestamp_eof) {
   MessageBuilder msg;
   auto event = msg.initEvent(valid);
+  if (trace_timestamp_eof != 0) {
+    auto trace = event.initTrace();
+    trace.setFrameId(trace_frame_id);
+    trace.setTimestampEof(trace_timestamp_eof);
+  }
 
   auto canData = sendCan ? event.initSendcan(can_list.size()) : event.initCan(can_list.size());
   int j = 0;
@@ -344,6 +344,11 @@ void Panda::send_heartbeat() {
 }
 
 void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
+  can_pack(can_data_list);
+  can_send_packed();
+}
+
+void Panda::can_pack(capnp::List<cereal::CanData>::Reader can_data_list) {
   send.resize(4 * can_data_list.size());
 
   uint32_t msg_cnt = 0;
@@ -356,20 +361,28 @@ void Panda::can_send(capnp::List<cereal::CanData>::Reader can_data_list) {
       continue;
     }
 
+    // the USB protocol carries classic frames only
+    auto can_data = cmsg.getDat();
+    if (can_data.size() > 8) {
+      LOGE("can_send: dropping %zu byte CAN FD frame to 0x%X", can_data.size(), cmsg.getAddress());
+      continue;
+    }
+
     if (cmsg.getAddress() >= 0x800) { // extended
       send[msg_cnt*4] = (cmsg.getAddress() << 3) | 5;
     } else { // normal
       send[msg_cnt*4] = (cmsg.getAddress() << 21) | 1;
     }
-    auto can_data = cmsg.getDat();
-    assert(can_data.size() <= 8);
     send[msg_cnt*4+1] = can_data.size() | ((bus - bus_offset) << 4);
     memcpy(&send[msg_cnt*4+2], can_data.begin(), can_data.size());
 
     msg_cnt++;
   }
+  send_cnt = msg_cnt;
+}
 
-  usb_bulk_write(3, (unsigned char*)send.data(), msg_cnt * 0x10, 5);
+void Panda::can_send_packed() {
+  usb_bulk_write(3, (unsigned char*)send.data(), send_cnt * 0x10, 5);
 }
 
 bool Panda::can_receive(std::vector<can_frame>& out_vec) {
@@ -54,6 +54,7 @@ class Panda {
   libusb_device_handle *dev_handle = NULL;
   std::mutex usb_lock;
   std::vector<uint32_t> send;
+  uint32_t send_cnt = 0;
   void handle_usb_issue(int err, const char func[]);
   void cleanup();
 
@@ -94,5 +95,8 @@ class Panda {
   void set_usb_power_mode(cereal::PeripheralState::UsbPowerMode power_mode);
   void send_heartbeat();
   void can_send(capnp::List<cereal::CanData>::Reader can_data_list);
+  // can_send in two steps, so a leased list can be dropped before anything is written
+  void can_pack(capnp::List<cereal::CanData>::Reader can_data_list);
+  void can_send_packed();
   bool can_receive(std::vector<can_frame>& out_vec);
 };
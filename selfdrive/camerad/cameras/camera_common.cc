@@ -166,6 +166,9 @@ bool CameraBuf::acquire() {
   cur_yuv_buf = vipc_server->get_buffer(yuv_type);
   rgb2yuv->queue(q, cur_rgb_buf->buf_cl, cur_yuv_buf->buf_cl);
 
+  cur_rgb_buf->set_dirty(VISIONBUF_SYNC_FROM_DEVICE);
+  cur_yuv_buf->set_dirty(VISIONBUF_SYNC_FROM_DEVICE);
+
   VisionIpcBufExtra extra = {
                         cur_frame_data.frame_id,
                         cur_frame_data.timestamp_sof,
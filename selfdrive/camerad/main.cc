@@ -30,6 +30,8 @@ ExitHandler do_exit;
 void party(cl_device_id device_id, cl_context context) {
   MultiCameraState cameras = {};
   VisionIpcServer vipc_server("camerad", device_id, context);
+  // Buffers are marked dirty in CameraBuf::acquire after the kernels wrote them
+  vipc_server.track_dirty = true;
 
   cameras_init(&vipc_server, &cameras, device_id, context);
   cameras_open(&cameras);
@@ -3,26 +3,19 @@
 #include <cstdint>
 #include <ctime>
 
-#ifdef __APPLE__
-#define CLOCK_BOOTTIME CLOCK_MONOTONIC
-#endif
+#include "cereal/messaging/sim_clock.h"
 
+// Boot time follows the simulated clock when SIM_CLOCK=1
 static inline uint64_t nanos_since_boot() {
-  struct timespec t;
-  clock_gettime(CLOCK_BOOTTIME, &t);
-  return t.tv_sec * 1000000000ULL + t.tv_nsec;
+  return sim_clock_nanos_since_boot();
 }
 
 static inline double millis_since_boot() {
-  struct timespec t;
-  clock_gettime(CLOCK_BOOTTIME, &t);
-  return t.tv_sec * 1000.0 + t.tv_nsec * 1e-6;
+  return nanos_since_boot() * 1e-6;
 }
 
 static inline double seconds_since_boot() {
-  struct timespec t;
-  clock_gettime(CLOCK_BOOTTIME, &t);
-  return (double)t.tv_sec + t.tv_nsec * 1e-9;
+  return nanos_since_boot() * 1e-9;
 }
 
 static inline uint64_t nanos_since_epoch() {
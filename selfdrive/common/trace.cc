@@ -0,0 +1,102 @@
+#include "selfdrive/common/trace.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include "selfdrive/common/swaglog.h"
+
+#define TRACE_RING_SIZE 1024
+#define TRACE_FLUSH_INTERVAL_NS 1000000000ULL
+#define TRACE_SPANS_PER_LOG 64
+
+namespace {
+
+struct TraceSlot {
+  std::atomic<uint64_t> seq;  // index + 1 of the span in this slot, 0 while being written
+  TraceSpan span;
+};
+
+struct TraceRing {
+  TraceSlot slots[TRACE_RING_SIZE] = {};
+  std::atomic<uint64_t> head = 0;
+
+  std::mutex lock;  // serializes consumers
+  uint64_t tail = 0;
+  uint64_t last_flush = 0;
+};
+
+TraceRing ring;
+
+}  // namespace
+
+void trace::record(const char *name, uint32_t frame_id, uint64_t start_ns, uint64_t end_ns) {
+  uint64_t idx = ring.head.fetch_add(1, std::memory_order_relaxed);
+  TraceSlot &slot = ring.slots[idx % TRACE_RING_SIZE];
+
+  slot.seq.store(0, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.span = {name, frame_id, start_ns, end_ns};
+  slot.seq.store(idx + 1, std::memory_order_release);
+}
+
+std::vector<TraceSpan> trace::drain(uint64_t *dropped) {
+  std::lock_guard lk(ring.lock);
+  std::vector<TraceSpan> spans;
+  uint64_t lost = 0;
+
+  uint64_t head = ring.head.load(std::memory_order_acquire);
+  if (head - ring.tail > TRACE_RING_SIZE) {
+    lost += head - ring.tail - TRACE_RING_SIZE;
+    ring.tail = head - TRACE_RING_SIZE;
+  }
+
+  for (; ring.tail < head; ring.tail++) {
+    TraceSlot &slot = ring.slots[ring.tail % TRACE_RING_SIZE];
+    if (slot.seq.load(std::memory_order_acquire) != ring.tail + 1) {
+      // Still being written, pick it up next time
+      if (slot.seq.load(std::memory_order_relaxed) == 0) break;
+      lost++;
+      continue;
+    }
+
+    TraceSpan span = slot.span;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) != ring.tail + 1) {
+      lost++;  // overwritten while copying
+      continue;
+    }
+    spans.push_back(span);
+  }
+
+  if (dropped) *dropped = lost;
+  return spans;
+}
+
+void trace::flush(bool force) {
+  uint64_t now = nanos_since_boot();
+  {
+    std::lock_guard lk(ring.lock);
+    if (!force && now - ring.last_flush < TRACE_FLUSH_INTERVAL_NS) return;
+    ring.last_flush = now;
+  }
+
+  uint64_t dropped = 0;
+  std::vector<TraceSpan> spans = drain(&dropped);
+  if (dropped > 0) {
+    LOGW("trace: dropped %lu spans", (unsigned long)dropped);
+  }
+
+  // "trace_spans" followed by [name, frame_id, start_ns, end_ns] tuples, parsed by trace_latency.py
+  for (size_t i = 0; i < spans.size(); i += TRACE_SPANS_PER_LOG) {
+    std::string s = "trace_spans [";
+    for (size_t j = i; j < spans.size() && j < i + TRACE_SPANS_PER_LOG; j++) {
+      const TraceSpan &span = spans[j];
+      if (j != i) s += ",";
+      s += "[\"" + std::string(span.name) + "\"," + std::to_string(span.frame_id) + "," +
+           std::to_string(span.start_ns) + "," + std::to_string(span.end_ns) + "]";
+    }
+    s += "]";
+    LOGD("%s", s.c_str());
+  }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "selfdrive/common/timing.h"
+
+// In-process latency tracing. Spans are recorded into a fixed size lock-free ring
+// and periodically flushed to swaglog, so they end up in the rlog next to the
+// messages they belong to. selfdrive/debug/trace_latency.py reconstructs per-frame
+// critical paths from them.
+
+struct TraceSpan {
+  const char *name;  // must outlive the recorder, use string literals
+  uint32_t frame_id;
+  uint64_t start_ns;
+  uint64_t end_ns;
+};
+
+namespace trace {
+
+void record(const char *name, uint32_t frame_id, uint64_t start_ns, uint64_t end_ns);
+
+// Returns all spans recorded since the last drain, oldest first. Spans that were
+// overwritten before being drained are counted in dropped.
+std::vector<TraceSpan> drain(uint64_t *dropped = nullptr);
+
+// Logs the pending spans, at most once per interval unless forced
+void flush(bool force = false);
+
+class Span {
+public:
+  Span(const char *name, uint32_t frame_id) : name(name), frame_id(frame_id), start_ns(nanos_since_boot()) {}
+  ~Span() { record(name, frame_id, start_ns, nanos_since_boot()); }
+
+private:
+  const char *name;
+  uint32_t frame_id;
+  uint64_t start_ns;
+};
+
+}  // namespace trace
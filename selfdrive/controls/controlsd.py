@@ -655,7 +655,8 @@ class Controls:
     if not self.read_only and self.initialized:
       # send car controls over can
       can_sends = self.CI.apply(CC, self)
-      self.pm.send('sendcan', can_list_to_can_capnp(can_sends, msgtype='sendcan', valid=CS.canValid))
+      self.pm.send('sendcan', can_list_to_can_capnp(can_sends, msgtype='sendcan', valid=CS.canValid,
+                                                    trace=self.sm.trace['lateralPlan']))
 
     force_decel = (self.sm['driverMonitoringState'].awarenessStatus < 0.) or \
                   (self.state == State.softDisabling)
@@ -749,6 +750,7 @@ class Controls:
     # carControl
     cc_send = messaging.new_message('carControl')
     cc_send.valid = CS.canValid
+    cc_send.trace = self.sm.trace['lateralPlan']
     cc_send.carControl = CC
     self.pm.send('carControl', cc_send)
 
@@ -117,6 +117,7 @@ class Planner():
     plan_send = messaging.new_message('longitudinalPlan')
 
     plan_send.valid = sm.all_alive_and_valid(service_list=['carState', 'controlsState'])
+    plan_send.trace = sm.trace['modelV2']
 
     longitudinalPlan = plan_send.longitudinalPlan
     longitudinalPlan.modelMonoTime = sm.logMonoTime['modelV2']
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+import argparse
+import json
+from collections import defaultdict
+
+import numpy as np
+
+from tools.lib.logreader import LogReader
+
+# Reconstructs the camera -> model -> plan -> control path of every frame from an rlog,
+# using the trace context carried by each message and the spans logged by selfdrive/common/trace.cc
+
+# stages in pipeline order, the first message of each service carrying a frame id is used
+STAGES = ['modelV2', 'lateralPlan', 'longitudinalPlan', 'carControl', 'sendcan']
+
+
+def parse_spans(msg, spans):
+  try:
+    record = json.loads(msg.logMessage)
+  except (ValueError, TypeError):
+    return
+  if not isinstance(record, dict) or not str(record.get('msg', '')).startswith('trace_spans '):
+    return
+
+  for name, frame_id, start, end in json.loads(record['msg'][len('trace_spans '):]):
+    spans[frame_id][name] = (start, end)
+
+
+def reconstruct(lr):
+  frames = defaultdict(dict)
+  eof = {}
+  spans = defaultdict(dict)
+
+  for msg in lr:
+    w = msg.which()
+    if w == 'logMessage':
+      parse_spans(msg, spans)
+    elif w in STAGES and msg.trace.timestampEof != 0:
+      frame_id = msg.trace.frameId
+      eof[frame_id] = msg.trace.timestampEof
+      if w not in frames[frame_id]:
+        frames[frame_id][w] = msg.logMonoTime
+
+  paths = []
+  for frame_id in sorted(frames):
+    path = {'frame_id': frame_id, 'eof': eof[frame_id], 'stages': [], 'spans': spans.get(frame_id, {})}
+    prev = eof[frame_id]
+    for s in STAGES:
+      if s in frames[frame_id]:
+        t = frames[frame_id][s]
+        path['stages'].append((s, (t - prev) / 1e6, (t - eof[frame_id]) / 1e6))
+        prev = t
+    paths.append(path)
+  return paths
+
+
+def print_summary(paths):
+  deltas = defaultdict(list)
+  totals = defaultdict(list)
+  span_durations = defaultdict(list)
+  for p in paths:
+    for s, dt, total in p['stages']:
+      deltas[s].append(dt)
+      totals[s].append(total)
+    for name, (start, end) in p['spans'].items():
+      span_durations[name].append((end - start) / 1e6)
+
+  print(f"{len(paths)} frames\n")
+  print(f"{'stage':<20} {'n':>6} {'step p50':>9} {'step p99':>9} {'eof p50':>9} {'eof p99':>9}  (ms)")
+  for s in STAGES:
+    if len(deltas[s]) == 0:
+      continue
+    print(f"{s:<20} {len(deltas[s]):>6} {np.percentile(deltas[s], 50):>9.2f} {np.percentile(deltas[s], 99):>9.2f} "
+          f"{np.percentile(totals[s], 50):>9.2f} {np.percentile(totals[s], 99):>9.2f}")
+
+  if len(span_durations):
+    print(f"\n{'span':<20} {'n':>6} {'p50':>9} {'p99':>9} {'max':>9}  (ms)")
+    for name in sorted(span_durations):
+      d = span_durations[name]
+      print(f"{name:<20} {len(d):>6} {np.percentile(d, 50):>9.2f} {np.percentile(d, 99):>9.2f} {max(d):>9.2f}")
+
+
+def print_slowest(paths, n):
+  # frames where the command took the longest to reach the car
+  done = [p for p in paths if len(p['stages']) and p['stages'][-1][0] == STAGES[-1]]
+  done.sort(key=lambda p: p['stages'][-1][2], reverse=True)
+
+  print(f"\nslowest {min(n, len(done))} frames")
+  for p in done[:n]:
+    steps = ", ".join(f"{s} +{dt:.1f}" for s, dt, _ in p['stages'])
+    span_s = ", ".join(f"{name} {(end - start) / 1e6:.1f}" for name, (start, end) in sorted(p['spans'].items()))
+    print(f"frame {p['frame_id']}: {p['stages'][-1][2]:.1f} ms total | {steps}" + (f" | {span_s}" if span_s else ""))
+
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Reconstruct per-frame pipeline latency from an rlog",
+                                   formatter_class=argparse.ArgumentDefaultsHelpFormatter)
+  parser.add_argument("rlog", help="Path or url of the rlog")
+  parser.add_argument("--slowest", type=int, default=10, help="Number of slowest frames to print")
+  args = parser.parse_args()
+
+  paths = reconstruct(LogReader(args.rlog))
+  print_summary(paths)
+  print_slowest(paths, args.slowest)
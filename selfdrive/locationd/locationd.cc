@@ -18,6 +18,7 @@ const double MIN_STD_SANITY_CHECK = 1e-5; // m or rad
 const double VALID_TIME_SINCE_RESET = 1.0; // s
 const double VALID_POS_STD = 50.0; // m
 const double MAX_RESET_TRACKER = 5.0;
+const uint64_t REORDER_WINDOW = 10 * 1000 * 1000; // ns, inputs are handled in logMonoTime order within this window
 
 static VectorXd floatlist2vector(const capnp::List<float, capnp::Kind::PRIMITIVE>::Reader& floatlist) {
   VectorXd res(floatlist.size());
@@ -450,29 +451,29 @@ bool Localizer::isGpsOK() {
 int Localizer::locationd_thread() {
   const std::initializer_list<const char *> service_list =
       { "gpsLocationExternal", "sensorEvents", "cameraOdometry", "liveCalibration", "carState" };
-  PubMaster pm({ "liveLocationKalman" });
-  SubMaster sm(service_list, nullptr, { "gpsLocationExternal" });
+  PubMaster pm({ ServiceId::liveLocationKalman });
+  MergeReceiver receiver(service_list, REORDER_WINDOW, { "gpsLocationExternal" });
+  SubMaster &sm = receiver.status;
 
   Params params;
 
   while (!do_exit) {
-    sm.update();
-    for (const char* service : service_list) {
-      if (sm.updated(service) && sm.valid(service)) {
-        const cereal::Event::Reader log = sm[service];
+    for (auto &[service, log] : receiver.receive()) {
+      if (log.getValid()) {
         this->handle_msg(log);
       }
-    }
+      if (service != "cameraOdometry") {
+        continue;
+      }
 
-    if (sm.updated("cameraOdometry")) {
-      uint64_t logMonoTime = sm["cameraOdometry"].getLogMonoTime();
+      uint64_t logMonoTime = log.getLogMonoTime();
       bool inputsOK = sm.allAliveAndValid();
-      bool sensorsOK = sm.alive("sensorEvents") && sm.valid("sensorEvents");
+      bool sensorsOK = sm.alive(ServiceId::sensorEvents) && sm.valid(ServiceId::sensorEvents);
       bool gpsOK = this->isGpsOK();
 
       MessageBuilder msg_builder;
       kj::ArrayPtr<capnp::byte> bytes = this->get_message_bytes(msg_builder, logMonoTime, inputsOK, sensorsOK, gpsOK);
-      pm.send("liveLocationKalman", bytes.begin(), bytes.size());
+      pm.send(ServiceId::liveLocationKalman, bytes.begin(), bytes.size());
 
       if (sm.frame % 1200 == 0 && gpsOK) {  // once a minute
         VectorXd posGeo = this->get_position_geodetic();
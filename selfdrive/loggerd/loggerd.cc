@@ -154,6 +154,8 @@ void encoder_thread(const LogCameraInfo &cam_info) {
   LoggerHandle *lh = NULL;
   std::vector<Encoder *> encoders;
   VisionIpcClient vipc_client = VisionIpcClient("camerad", cam_info.stream_type, false);
+  // Frames are only read on the CPU by the encoders
+  vipc_client.track_dirty = true;
 
   while (!do_exit) {
     if (!vipc_client.connect(false)) {
@@ -9,6 +9,7 @@
 #include "selfdrive/common/clutil.h"
 #include "selfdrive/common/params.h"
 #include "selfdrive/common/swaglog.h"
+#include "selfdrive/common/trace.h"
 #include "selfdrive/common/util.h"
 #include "selfdrive/hardware/hw.h"
 #include "selfdrive/modeld/models/driving.h"
@@ -23,7 +24,8 @@ void calibration_thread(bool wide_camera) {
   set_thread_name("calibration");
   set_realtime_priority(50);
 
-  SubMaster sm({"liveCalibration"});
+  // Replay the last calibration so a restarted modeld can run right away
+  SubMaster sm({ServiceId::liveCalibration}, nullptr, {}, {ServiceId::liveCalibration});
 
   /*
      import numpy as np
@@ -42,8 +44,8 @@ void calibration_thread(bool wide_camera) {
 
   while (!do_exit) {
     sm.update(100);
-    if(sm.updated("liveCalibration")){
-      auto extrinsic_matrix = sm["liveCalibration"].getLiveCalibration().getExtrinsicMatrix();
+    if(sm.updated(ServiceId::liveCalibration)){
+      auto extrinsic_matrix = sm[ServiceId::liveCalibration].getLiveCalibration().getExtrinsicMatrix();
       Eigen::Matrix<float, 3, 4> extrinsic_matrix_eigen;
       for (int i = 0; i < 4*3; i++){
         extrinsic_matrix_eigen(i / 4, i % 4) = extrinsic_matrix[i];
@@ -70,8 +72,8 @@ void calibration_thread(bool wide_camera) {
 
 void run_model(ModelState &model, VisionIpcClient &vipc_client) {
   // messaging
-  PubMaster pm({"modelV2", "cameraOdometry"});
-  SubMaster sm({"lateralPlan", "roadCameraState"});
+  PubMaster pm({ServiceId::modelV2, ServiceId::cameraOdometry});
+  SubMaster sm({ServiceId::lateralPlan, ServiceId::roadCameraState});
 
   // setup filter to track dropped frames
   FirstOrderFilter frame_dropped_filter(0., 10., 1. / MODEL_FREQ);
@@ -81,9 +83,11 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client) {
   uint32_t run_count = 0;
 
   while (!do_exit) {
+    // Frames and messages are waited on in one poll, sm is fresh when a frame arrives
     VisionIpcBufExtra extra = {};
-    VisionBuf *buf = vipc_client.recv(&extra);
+    VisionBuf *buf = vipc_client.recv(sm, &extra);
     if (buf == nullptr) continue;
+    trace::record("modeld.vipc", extra.frame_id, extra.timestamp_sent, nanos_since_boot());
 
     transform_lock.lock();
     mat3 model_transform = cur_transform;
@@ -91,9 +95,8 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client) {
     transform_lock.unlock();
 
     // TODO: path planner timeout?
-    sm.update(0);
-    int desire = ((int)sm["lateralPlan"].getLateralPlan().getDesire());
-    frame_id = sm["roadCameraState"].getRoadCameraState().getFrameId();
+    int desire = ((int)sm[ServiceId::lateralPlan].getLateralPlan().getDesire());
+    frame_id = sm[ServiceId::roadCameraState].getRoadCameraState().getFrameId();
 
     if (run_model_this_iter) {
       run_count++;
@@ -103,10 +106,12 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client) {
         vec_desire[desire] = 1.0;
       }
 
+      uint64_t eval_start = nanos_since_boot();
       double mt1 = millis_since_boot();
       ModelDataRaw model_buf = model_eval_frame(&model, buf->buf_cl, buf->width, buf->height,
                                                 model_transform, vec_desire);
       double mt2 = millis_since_boot();
+      trace::record("modeld.eval", extra.frame_id, eval_start, nanos_since_boot());
       float model_execution_time = (mt2 - mt1) / 1000.0;
 
       // tracked dropped frames
@@ -119,14 +124,18 @@ void run_model(ModelState &model, VisionIpcClient &vipc_client) {
 
       float frame_drop_ratio = frames_dropped / (1 + frames_dropped);
 
-      model_publish(pm, extra.frame_id, frame_id, frame_drop_ratio, model_buf, extra.timestamp_eof, model_execution_time,
-                    kj::ArrayPtr<const float>(model.output.data(), model.output.size()));
-      posenet_publish(pm, extra.frame_id, vipc_dropped_frames, model_buf, extra.timestamp_eof);
+      {
+        trace::Span span("modeld.publish", extra.frame_id);
+        model_publish(pm, extra.frame_id, frame_id, frame_drop_ratio, model_buf, extra.timestamp_eof, model_execution_time,
+                      kj::ArrayPtr<const float>(model.output.data(), model.output.size()));
+        posenet_publish(pm, extra.frame_id, vipc_dropped_frames, model_buf, extra.timestamp_eof);
+      }
 
       //printf("model process: %.2fms, from last %.2fms, vipc_frame_id %u, frame_id, %u, frame_drop %.3f\n", mt2 - mt1, mt1 - last, extra.frame_id, frame_id, frame_drop_ratio);
       last = mt1;
       last_vipc_frame_id = extra.frame_id;
     }
+    trace::flush();
   }
 }
 
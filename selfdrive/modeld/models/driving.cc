@@ -330,7 +330,12 @@ void model_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t frame_id, flo
                    float model_execution_time, kj::ArrayPtr<const float> raw_pred) {
   const uint32_t frame_age = (frame_id > vipc_frame_id) ? (frame_id - vipc_frame_id) : 0;
   MessageBuilder msg;
-  auto framed = msg.initEvent().initModelV2();
+  auto event = msg.initEvent();
+  auto trace = event.initTrace();
+  trace.setFrameId(vipc_frame_id);
+  trace.setTimestampEof(timestamp_eof);
+
+  auto framed = event.initModelV2();
   framed.setFrameId(vipc_frame_id);
   framed.setFrameAge(frame_age);
   framed.setFrameDropPerc(frame_drop * 100);
@@ -340,7 +345,7 @@ void model_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t frame_id, flo
     framed.setRawPredictions(raw_pred.asBytes());
   }
   fill_model(framed, net_outputs);
-  pm.send("modelV2", msg);
+  pm.send(ServiceId::modelV2, msg);
 }
 
 void posenet_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t vipc_dropped_frames,
@@ -351,7 +356,12 @@ void posenet_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t vipc_droppe
   auto v_std = net_outputs.pose->velocity_std;
   auto r_std = net_outputs.pose->rotation_std;
 
-  auto posenetd = msg.initEvent(vipc_dropped_frames < 1).initCameraOdometry();
+  auto event = msg.initEvent(vipc_dropped_frames < 1);
+  auto trace = event.initTrace();
+  trace.setFrameId(vipc_frame_id);
+  trace.setTimestampEof(timestamp_eof);
+
+  auto posenetd = event.initCameraOdometry();
   posenetd.setTrans({v_mean.x, v_mean.y, v_mean.z});
   posenetd.setRot({r_mean.x, r_mean.y, r_mean.z});
   posenetd.setTransStd({exp(v_std.x), exp(v_std.y), exp(v_std.z)});
@@ -360,5 +370,5 @@ void posenet_publish(PubMaster &pm, uint32_t vipc_frame_id, uint32_t vipc_droppe
   posenetd.setTimestampEof(timestamp_eof);
   posenetd.setFrameId(vipc_frame_id);
 
-  pm.send("cameraOdometry", msg);
+  pm.send(ServiceId::cameraOdometry, msg);
 }
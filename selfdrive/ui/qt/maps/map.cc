@@ -23,7 +23,7 @@ const float MAP_SCALE = 2;
 
 MapWindow::MapWindow(const QMapboxGLSettings &settings) :
   m_settings(settings), velocity_filter(0, 10, 0.1) {
-  sm = new SubMaster({"liveLocationKalman", "navInstruction", "navRoute"});
+  sm = new SubMaster(SubHub::instance(), {"liveLocationKalman", "navInstruction", "navRoute"});
 
   timer = new QTimer(this);
   QObject::connect(timer, SIGNAL(timeout()), this, SLOT(timerUpdate()));
@@ -7,6 +7,7 @@
 #include <csignal>
 #include <iostream>
 
+#include "cereal/messaging/messaging.h"
 #include "selfdrive/ui/replay/replay.h"
 
 const QString DEMO_ROUTE = "4cf7a6ad03080c90|2021-09-29--13-46-36";
@@ -102,6 +103,7 @@ int main(int argc, char *argv[]) {
       {"no-cache", REPLAY_FLAG_NO_FILE_CACHE, "turn off local cache"},
       {"qcam", REPLAY_FLAG_QCAMERA, "load qcamera"},
       {"yuv", REPLAY_FLAG_SEND_YUV, "send yuv frame"},
+      {"lockstep", REPLAY_FLAG_LOCKSTEP, "run as fast as subscribers consume, drives the clock of processes started with SIM_CLOCK=1"},
   };
 
   QCommandLineParser parser;
@@ -133,6 +135,10 @@ int main(int argc, char *argv[]) {
       replay_flags |= flag;
     }
   }
+  if ((replay_flags & REPLAY_FLAG_LOCKSTEP) && messaging_use_zmq()) {
+    qCritical() << "--lockstep needs msgq, ZMQ publishers can't tell what their subscribers received";
+    return 1;
+  }
   replay = new Replay(route, allow, block, nullptr, replay_flags, parser.value("data_dir"), &app);
   if (!replay->load()) {
     return 0;
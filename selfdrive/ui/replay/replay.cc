@@ -246,6 +246,8 @@ void Replay::publishMessage(const Event *e) {
     if (ret == -1) {
       qDebug() << "stop publishing" << sockets_[e->which] << "due to multiple publishers error";
       sockets_[e->which] = nullptr;
+    } else if ((flags_ & REPLAY_FLAG_LOCKSTEP) && !pm->wait_readers_updated(sockets_[e->which], 1000)) {
+      qDebug() << "timeout waiting for subscribers of" << sockets_[e->which];
     }
   } else {
     sm->update_msgs(nanos_since_boot(), {{sockets_[e->which], e->event}});
@@ -310,7 +312,15 @@ void Replay::stream() {
         pm->send(sockets_[cereal::Event::Which::PANDA_STATES], msg);
       }
 
-      if (cur_which < sockets_.size() && sockets_[cur_which] != nullptr) {
+      if (cur_which < sockets_.size() && sockets_[cur_which] != nullptr && (flags_ & REPLAY_FLAG_LOCKSTEP)) {
+        // time comes from the log, the next message goes out once all subscribers consumed this one
+        sim_clock_set(cur_mono_time_);
+        if (evt->frame) {
+          publishFrame(evt);
+        } else {
+          publishMessage(evt);
+        }
+      } else if (cur_which < sockets_.size() && sockets_[cur_which] != nullptr) {
         // keep time
         long etime = cur_mono_time_ - evt_start_ts;
         long rtime = nanos_since_boot() - loop_start_ts;
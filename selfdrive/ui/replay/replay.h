@@ -16,6 +16,7 @@ enum REPLAY_FLAGS {
   REPLAY_FLAG_NO_FILE_CACHE = 0x0020,
   REPLAY_FLAG_QCAMERA = 0x0040,
   REPLAY_FLAG_SEND_YUV = 0x0080,
+  REPLAY_FLAG_LOCKSTEP = 0x0100,
 };
 
 class Replay : public QObject {
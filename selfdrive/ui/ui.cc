@@ -279,7 +279,7 @@ static void update_extras(UIState *s)
 
 
 QUIState::QUIState(QObject *parent) : QObject(parent) {
-  ui_state.sm = std::make_unique<SubMaster, const std::initializer_list<const char *>>({
+  ui_state.sm = std::make_unique<SubMaster>(SubHub::instance(), std::vector<const char *>{
     "modelV2", "controlsState", "liveCalibration", "deviceState", "roadCameraState",
     "pandaStates", "carParams", "driverMonitoringState", "sensorEvents", "carState", "liveLocationKalman",
     "gpsLocationExternal", "radarState", "carControl", "liveParameters", "ubloxGnss"});